@@ -1,15 +1,23 @@
 #pragma once
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <functional>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <system_error>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 struct libzfs_handle;
@@ -19,6 +27,8 @@ struct nvlist;
 struct nvpair;
 namespace zfspp {
 
+	template<typename T>
+	class span;
 	enum class nv_type;
 	class nv_pair;
 	class nv_list;
@@ -26,8 +36,70 @@ namespace zfspp {
 	class zfs;
 	enum class pool_status;
 	class pool;
+	enum class pool_property;
+	enum class import_flags;
+	struct importable_pool;
+	struct pool_summary;
 	class dataset;
+	struct send_progress;
+	struct send_options;
+	struct receive_stats;
+	struct receive_options;
+	enum class diff_kind;
+	enum class file_type;
+	struct diff_record;
+	struct snapshot_info;
+	struct retention_policy;
+	struct retention_plan;
+	struct channel_program_limits;
+	enum class latency_histogram;
+	struct vdev_iostat;
+	struct iostat_sample;
+	class iostat_sampler;
+	enum class vdev_state;
+	enum class vdev_role;
+	struct vdev_node;
+	class vdev_tree;
+	class vdev_topology;
+	enum class scan_function;
+	enum class scan_state;
+	struct scan_stats;
+	class scan_monitor;
+	class event_filter;
+	enum class zevent_type;
+	struct zevent;
+	enum class overflow_policy;
+	class event_queue;
 	class event_watcher;
+	class mount_resolver;
+	class dataset_cache;
+	struct replication_task;
+	struct replication_result;
+	struct replication_link;
+	struct replication_options;
+	class replication_job;
+
+	/** Minimal non-owning view of contiguous elements, until the library can require C++20 */
+	template<typename T>
+	class span {
+		T* m_data{};
+		size_t m_size{};
+
+	public:
+		constexpr span() noexcept = default;
+		constexpr span(T* data, size_t size) noexcept : m_data(data), m_size(size) {}
+		template<typename TContainer>
+		constexpr span(TContainer& container) noexcept : m_data(container.data()), m_size(container.size()) {}
+
+		constexpr T* data() const noexcept { return m_data; }
+		constexpr size_t size() const noexcept { return m_size; }
+		constexpr bool empty() const noexcept { return m_size == 0; }
+		constexpr T* begin() const noexcept { return m_data; }
+		constexpr T* end() const noexcept { return m_data + m_size; }
+		constexpr T& operator[](size_t idx) const noexcept { return m_data[idx]; }
+		constexpr T& front() const noexcept { return m_data[0]; }
+		constexpr T& back() const noexcept { return m_data[m_size - 1]; }
+	};
 
 	enum class nv_type {
 		unknown = 0,
@@ -128,6 +200,12 @@ namespace zfspp {
 		~nv_list();
 
 		::nvlist* raw() const noexcept { return m_handle; }
+		/** Give up ownership of the list without freeing it */
+		::nvlist* release() noexcept {
+			auto res = m_handle;
+			m_handle = nullptr;
+			return res;
+		}
 
 		void clear();
 		size_t size() const noexcept;
@@ -187,6 +265,141 @@ namespace zfspp {
 		any = 0x1f,
 	};
 
+	struct send_progress {
+		uint64_t bytes_written;
+		uint64_t estimated_size;
+	};
+
+	struct send_options {
+		/** Incremental source snapshot or bookmark, empty for a full stream. '@' or '#' names are relative */
+		std::string from;
+		/** Include all snapshots since from (zfs send -I), which has to be a snapshot of this dataset or its origin */
+		bool intermediates{false};
+		bool raw{false};
+		bool compressed{false};
+		bool large_blocks{false};
+		bool embedded{false};
+		/** Splice pipe and socket sinks through an internal pipe for exact byte counts and progress */
+		bool use_splice{true};
+		std::chrono::milliseconds progress_interval{1000};
+		std::function<void(const send_progress&)> on_progress;
+	};
+
+	/** Transfer counters of a receive, only elapsed is collected if prefetching is disabled */
+	struct receive_stats {
+		uint64_t bytes_received;
+		std::chrono::nanoseconds elapsed;
+		/** Time the kernel was left waiting because no prefetched data was available */
+		std::chrono::nanoseconds input_stall;
+		/** Time the reader was blocked because all buffers were waiting for the kernel */
+		std::chrono::nanoseconds output_stall;
+
+		double bytes_per_second() const noexcept {
+			if (elapsed.count() == 0) return 0;
+			return static_cast<double>(bytes_received) * 1e9 / static_cast<double>(elapsed.count());
+		}
+	};
+
+	struct receive_options {
+		bool force{false};
+		bool resumable{false};
+		bool nomount{false};
+		/** Properties to override on the received dataset (zfs receive -o) */
+		nv_list properties;
+		/** Properties to ignore from the stream (zfs receive -x) */
+		std::set<std::string> excluded_properties;
+		/** Read-ahead buffers, buffer_count = 0 passes the fd to the kernel directly */
+		size_t buffer_size{16 << 20};
+		/** Read-ahead consumes the fd up to EOF, nothing may follow the stream on it (a second one, framing) */
+		size_t buffer_count{4};
+	};
+
+	enum class diff_kind {
+		added,
+		removed,
+		modified,
+		renamed,
+	};
+
+	enum class file_type {
+		unknown,
+		regular,
+		directory,
+		symlink,
+		block_device,
+		char_device,
+		fifo,
+		socket,
+	};
+
+	struct diff_record {
+		diff_kind kind;
+		file_type type;
+		/** Object number, which is also the inode number of the mounted filesystem */
+		uint64_t inode;
+		/** Path relative to the dataset root, starting with '/', empty for objects on the delete queue */
+		std::string path;
+		/** Path after the change, only set for renamed objects */
+		std::string new_path;
+		/** Link count change for hard links to an existing file, 0 if the file itself changed */
+		int64_t link_change;
+	};
+
+	struct snapshot_info {
+		std::string name;
+		/** Creation time in seconds since the epoch */
+		uint64_t creation;
+		/** Number of user holds */
+		uint64_t userrefs;
+		/** Hold tags, only filled if requested from list_snapshots() */
+		std::vector<std::string> holds;
+	};
+
+	/** A snapshot is kept if any rule selects it, buckets use creation + utc_offset and weeks start on monday */
+	struct retention_policy {
+		/** Only snapshots whose name after the '@' starts with prefix are managed, all others are kept */
+		std::string prefix;
+		size_t keep_last{0};
+		size_t hourly{0};
+		size_t daily{0};
+		size_t weekly{0};
+		/** Keep every snapshot with a user hold */
+		bool keep_held{true};
+		/** Keep snapshots holding any of these tags, requires holds in the listing */
+		std::set<std::string> hold_tags;
+		std::chrono::seconds utc_offset{0};
+	};
+
+	struct retention_plan {
+		/** Full names of the snapshots to destroy, grouped by dataset and sorted oldest first */
+		std::vector<std::string> destroy;
+		size_t kept;
+
+		/** One "dataset@snap1,snap2,..." line per dataset, the same syntax zfs destroy accepts */
+		std::string compact() const;
+	};
+
+	/** Flags for zfs::import_pool(), see ZFS_IMPORT_* */
+	enum class import_flags {
+		none = 0,
+		verbatim = (1 << 0),
+		any_host = (1 << 1),
+		missing_log = (1 << 2),
+		only = (1 << 3),
+		skip_mmp = (1 << 5),
+		load_keys = (1 << 6),
+		checkpoint = (1 << 7),
+	};
+
+	struct importable_pool {
+		std::string name;
+		uint64_t guid;
+		/** pool_state_t as found in the labels */
+		uint64_t state;
+		/** Config as assembled from the labels, pass it to zfs::import_pool() */
+		nv_list config;
+	};
+
 	class zfs {
 		std::recursive_mutex m_mutex;
 		libzfs_handle* m_handle{};
@@ -209,15 +422,49 @@ namespace zfspp {
 		std::vector<dataset> root_datasets();
 		dataset open_dataset(const std::string& name, dataset_type dt = dataset_type::any);
 		dataset open_dataset_from_fs_path(const std::string& path, dataset_type dt = dataset_type::any);
+		dataset open_dataset_from_fs_path(const std::string& path, const mount_resolver& resolver,
+										  dataset_type dt = dataset_type::any);
+
+		send_progress send_resume(const std::string& token, int fd, const send_options& options = {});
+		receive_stats receive(const std::string& target, int fd, const receive_options& options = {});
 
 		pool create_pool(const std::string& name, const nv_list& topology, const nv_list& pool_options,
 						 const nv_list& fs_options, bool enable_all_features = true);
+		pool create_pool(const std::string& name, const vdev_topology& topology, const nv_list& pool_options = {},
+						 const nv_list& fs_options = {}, bool enable_all_features = true);
 		pool open_pool(const std::string& name);
 		std::vector<pool> list_pools();
+		/** Summaries of all pools in one pass, entries of out are reused */
+		void pool_summaries(std::vector<pool_summary>& out);
+		/** Scans search_dirs (or the default directories) for importable pools, or only the cachefile */
+		std::vector<importable_pool> discover_importable(const std::vector<std::string>& search_dirs = {},
+														 bool use_cachefile = false);
+		/** Import a pool found by discover_importable(), datasets are not mounted */
+		pool import_pool(const nv_list& config, const nv_list& props = {}, import_flags flags = import_flags::none);
 
 		bool next_event(nv_list& data, size_t* n_dropped = nullptr, bool block = false);
+		/** Next event read is the one after eid, false if the kernel no longer holds it */
+		bool seek_event(uint64_t eid);
+		/** Pass every queued event to cb without blocking, the lock is not held while cb runs */
+		size_t drain_events(const std::function<void(const nv_list&)>& cb, size_t* n_dropped = nullptr);
+		/** Descriptor holding the zevent position, the kernel does not support poll() on it */
+		int event_fd() const noexcept { return m_eventfd; }
 
 		bool validate_dataset_name(const char* name, dataset_type dt, std::string* reason = nullptr);
+
+		std::vector<snapshot_info> list_snapshots(const std::string& root, bool recursive = true,
+												  bool with_holds = false);
+		std::map<std::string, std::error_code> destroy_snapshots(const std::vector<std::string>& names,
+																 bool defer = false);
+		std::map<std::string, std::error_code>
+		create_bookmarks(const std::map<std::string, std::string>& snapshot_to_bookmark);
+		/** Holds are released once cleanup_fd is closed if it is an open /dev/zfs descriptor */
+		std::map<std::string, std::error_code> hold(const std::vector<std::string>& snapshots, const std::string& tag,
+													int cleanup_fd = -1);
+		std::map<std::string, std::error_code> release(const std::vector<std::string>& snapshots,
+													   const std::string& tag);
+		/** Hold tags and their creation time for each snapshot, snapshots that no longer exist are skipped */
+		std::map<std::string, std::map<std::string, uint64_t>> holds(const std::vector<std::string>& snapshots);
 	};
 
 	enum class pool_status {
@@ -256,6 +503,264 @@ namespace zfspp {
 		ok
 	};
 
+	/** Pool properties, the values are the same as those of zpool_prop_t */
+	enum class pool_property {
+		name,
+		size,
+		capacity,
+		altroot,
+		health,
+		guid,
+		version,
+		bootfs,
+		delegation,
+		autoreplace,
+		cachefile,
+		failuremode,
+		listsnapshots,
+		autoexpand,
+		dedupditto,
+		dedupratio,
+		free,
+		allocated,
+		readonly,
+		ashift,
+		comment,
+		expandsize,
+		freeing,
+		fragmentation,
+		leaked,
+		maxblocksize,
+		tname,
+		maxdnodesize,
+		multihost,
+		checkpoint,
+		load_guid,
+		autotrim,
+		compatibility,
+	};
+	constexpr size_t pool_property_count = 33;
+
+	struct pool_summary {
+		std::string name;
+		uint64_t guid;
+		/** pool_state_t of the pool */
+		int state;
+		pool_status status;
+		uint64_t size;
+		uint64_t alloc;
+		uint64_t free;
+		/** Fragmentation of the free space in percent, UINT64_MAX if unknown */
+		uint64_t fragmentation;
+		/** Allocated space in percent */
+		uint64_t capacity;
+		/** Health as shown by zpool list, points to a static string */
+		const char* health;
+	};
+
+	struct channel_program_limits {
+		uint64_t instructions{10 * 1000 * 1000};
+		uint64_t memory{10 * 1024 * 1024};
+	};
+
+	enum class latency_histogram {
+		total_read,
+		total_write,
+		disk_read,
+		disk_write,
+		sync_queue_read,
+		sync_queue_write,
+		async_queue_read,
+		async_queue_write,
+	};
+	constexpr size_t latency_histogram_count = 8;
+	constexpr size_t latency_histogram_buckets = 37;
+
+	struct vdev_iostat {
+		uint64_t guid;
+		/** Allocated and total space, always the current value */
+		uint64_t alloc;
+		uint64_t space;
+		uint64_t read_ops;
+		uint64_t write_ops;
+		uint64_t read_bytes;
+		uint64_t write_bytes;
+		/** Error counters, always the total since import or the last clear */
+		uint64_t read_errors;
+		uint64_t write_errors;
+		uint64_t checksum_errors;
+	};
+
+	/** Latency histograms of a vdev indexed by latency_histogram, bucket i counts I/Os taking [2^i, 2^(i+1)) ns */
+	using latency_histograms = std::array<std::array<uint64_t, latency_histogram_buckets>, latency_histogram_count>;
+
+	/** Per-vdev statistics in vdev_tree order, the first entry is the root vdev */
+	struct iostat_sample {
+		/** Kernel timestamp of the sample in nanoseconds */
+		uint64_t timestamp;
+		/** Nanoseconds covered by the counters, 0 for a raw sample of cumulative counters */
+		uint64_t interval;
+		std::vector<vdev_iostat> vdevs;
+		/** Latency histograms in the order of vdevs, empty if the sample carries none */
+		std::vector<latency_histograms> latency;
+
+		const std::array<uint64_t, latency_histogram_buckets>& histogram(size_t vdev, latency_histogram h) const {
+			return latency.at(vdev)[static_cast<size_t>(h)];
+		}
+	};
+
+	enum class vdev_state {
+		unknown,
+		closed,
+		offline,
+		removed,
+		cant_open,
+		faulted,
+		degraded,
+		healthy,
+	};
+
+	enum class vdev_role {
+		normal,
+		log,
+		special,
+		dedup,
+		cache,
+		spare,
+	};
+
+	struct vdev_node {
+		uint64_t guid;
+		/** vdev type as reported by the kernel, e.g. "root", "mirror", "raidz", "disk" or "file" */
+		std::string type;
+		/** Device path of leaf vdevs, empty otherwise */
+		std::string path;
+		vdev_state state;
+		/** Raw vdev_aux_t explaining the state */
+		uint64_t aux;
+		uint64_t ashift;
+		/** Allocation class of the top-level vdev this one belongs to */
+		vdev_role role;
+		/** Index of the parent, vdev_tree::npos for the root */
+		size_t parent;
+		size_t child_count;
+		/** Number of nodes in the subtree rooted at this node, including the node itself */
+		size_t subtree_size;
+	};
+
+	/** Vdev topology in pre-order, the next sibling of node i is i + subtree_size */
+	class vdev_tree {
+		std::vector<vdev_node> m_nodes;
+
+		bool update_tree(::nvlist* root);
+
+	public:
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		vdev_tree() = default;
+		explicit vdev_tree(const nv_list& config) { update(config); }
+
+		/** Returns true if anything changed, unchanged nodes only get state and path updated */
+		bool update(const nv_list& config);
+		/** Refresh the pool stats and update the tree from the new config */
+		bool refresh(pool& p);
+
+		bool empty() const noexcept { return m_nodes.empty(); }
+		size_t size() const noexcept { return m_nodes.size(); }
+		const vdev_node& operator[](size_t idx) const noexcept { return m_nodes[idx]; }
+		std::vector<vdev_node>::const_iterator begin() const noexcept { return m_nodes.begin(); }
+		std::vector<vdev_node>::const_iterator end() const noexcept { return m_nodes.end(); }
+
+		size_t first_child(size_t idx) const noexcept { return m_nodes[idx].child_count != 0 ? idx + 1 : npos; }
+		size_t next_sibling(size_t idx) const noexcept {
+			auto next = idx + m_nodes[idx].subtree_size;
+			return next < m_nodes.size() && m_nodes[next].parent == m_nodes[idx].parent ? next : npos;
+		}
+		size_t find(uint64_t guid) const noexcept;
+	};
+
+	/** Builds the vdev tree for zfs::create_pool(), device paths are validated when added */
+	class vdev_topology {
+		struct leaf {
+			std::string path;
+			bool is_file;
+		};
+		struct group {
+			const char* type;
+			vdev_role role;
+			uint64_t ashift;
+			uint64_t nparity;
+			uint64_t ndata;
+			uint64_t nspares;
+			/** Range of the devices in m_leaves */
+			size_t first;
+			size_t count;
+		};
+		std::vector<leaf> m_leaves;
+		std::vector<group> m_groups;
+		std::set<std::string> m_paths;
+		uint64_t m_ashift{0};
+
+		void add_group(const char* type, vdev_role role, const std::vector<std::string>& paths, uint64_t nparity = 0,
+					   uint64_t ndata = 0, uint64_t nspares = 0);
+
+	public:
+		/** ashift of the devices added after this call, 0 lets the kernel pick it */
+		vdev_topology& ashift(uint64_t value);
+		vdev_topology& disk(const std::string& path, vdev_role role = vdev_role::normal);
+		vdev_topology& mirror(const std::vector<std::string>& paths, vdev_role role = vdev_role::normal);
+		vdev_topology& raidz(uint64_t parity, const std::vector<std::string>& paths,
+							 vdev_role role = vdev_role::normal);
+		/** data = 0 uses min(8, devices - spares - parity) like zpool create */
+		vdev_topology& draid(uint64_t parity, const std::vector<std::string>& paths, uint64_t data = 0,
+							 uint64_t spares = 0);
+		vdev_topology& cache(const std::vector<std::string>& paths);
+		vdev_topology& spare(const std::vector<std::string>& paths);
+
+		bool empty() const noexcept { return m_groups.empty(); }
+		/** Create the vdev nvlist, requires at least one normal vdev */
+		nv_list build() const;
+	};
+
+	enum class scan_function {
+		none,
+		scrub,
+		resilver,
+	};
+
+	enum class scan_state {
+		none,
+		scanning,
+		finished,
+		canceled,
+	};
+
+	/** Progress of the last scan, pass_* values restart when the pool is imported */
+	struct scan_stats {
+		scan_function function;
+		scan_state state;
+		/** Start and end time in seconds since the epoch, end_time is only set once the scan ended */
+		uint64_t start_time;
+		uint64_t end_time;
+		/** Bytes to scan, found by the scanner and verified so far */
+		uint64_t to_examine;
+		uint64_t examined;
+		uint64_t issued;
+		/** Bytes repaired by a scrub or resilvered by a resilver */
+		uint64_t processed;
+		uint64_t errors;
+		uint64_t pass_start;
+		uint64_t pass_examined;
+		uint64_t pass_issued;
+		/** Time the scrub was paused at, 0 if it is running */
+		uint64_t pass_paused_at;
+		/** Seconds the current pass spent paused */
+		uint64_t pass_paused_time;
+
+		bool active() const noexcept { return state == scan_state::scanning; }
+		bool paused() const noexcept { return active() && pass_paused_at != 0; }
+	};
+
 	class pool {
 		zfs* m_parent{};
 		zpool_handle* m_pool{};
@@ -294,32 +799,126 @@ namespace zfspp {
 		void checkpoint();
 		void discard_checkpoint();
 		void upgrade();
+
+		/** Lua errors and exceeded limits are thrown as std::system_error with the kernel's message */
+		nv_list run_channel_program(const std::string& program, const nv_list& args = {},
+									const channel_program_limits& limits = {}, bool sync = true);
+
+		/** Returns the offset after the last record, records are only valid during cb */
+		uint64_t read_history(uint64_t offset, const std::function<void(const nv_list&)>& cb);
+
+		/** Values are cached by the handle, use refresh_properties() for current values */
+		uint64_t get_uint64(pool_property prop) const noexcept;
+		/** Formatted value, or the raw value if literal is set (e.g. bytes instead of "1.5T") */
+		std::string get_string(pool_property prop, bool literal = false) const;
+		/** Values of all requested properties in the same order, read under a single lock */
+		std::vector<std::string> get_properties(const std::vector<pool_property>& props, bool literal = false) const;
+		/** Set every property in props to its string value, in order. Stops at the first failure */
+		void set_properties(const nv_list& props);
+		/** Reopen the handle to fetch the current properties */
+		void refresh_properties();
+
+		/** Refresh the pool stats and store the cumulative counters in out, reusing its storage */
+		void sample_iostat(iostat_sample& out);
+
+		/** Refresh the pool stats and return the progress of the last scan, function is none if there was none */
+		scan_stats scan_progress();
+		/** Start a scrub or resilver, or resume a paused scrub */
+		void start_scan(scan_function fn = scan_function::scrub);
+		void pause_scrub();
+		void cancel_scan();
+	};
+
+	/** Keeps per-interval I/O statistics of a pool allocated up front once the first sample gave the vdev count */
+	class iostat_sampler {
+		pool* m_pool{};
+		iostat_sample m_current{};
+		iostat_sample m_previous{};
+		bool m_has_previous{false};
+		std::vector<iostat_sample> m_history;
+		size_t m_head{0};
+		size_t m_size{0};
+		size_t m_vdev_count{0};
+		bool m_histograms{false};
+
+		void reserve(size_t vdev_count);
+
+	public:
+		/** Unless histograms is set only the most recent sample carries latency histograms */
+		iostat_sampler(pool& p, size_t history = 600, bool histograms = false);
+		iostat_sampler(const iostat_sampler&) = delete;
+		iostat_sampler(iostat_sampler&&) = delete;
+		iostat_sampler& operator=(const iostat_sampler&) = delete;
+		iostat_sampler& operator=(iostat_sampler&&) = delete;
+		~iostat_sampler() = default;
+
+		/** Take a sample, returns false if this was the first one and no interval could be computed yet */
+		bool sample();
+
+		size_t size() const noexcept { return m_size; }
+		size_t capacity() const noexcept { return m_history.size(); }
+		/** Interval sample by age, 0 is the most recent one */
+		const iostat_sample& at(size_t age) const;
+		void clear() noexcept;
 	};
 
+	/** Tracks the scan of a pool with time weighted exponentially smoothed rates */
+	class scan_monitor {
+		pool* m_pool{};
+		double m_smoothing{};
+		scan_stats m_stats{};
+		std::chrono::steady_clock::time_point m_time{};
+		bool m_has_sample{false};
+		double m_scan_rate{0};
+		double m_issue_rate{0};
+
+	public:
+		explicit scan_monitor(pool& p, std::chrono::seconds smoothing = std::chrono::seconds{60});
+
+		/** Sample the scan progress of the pool and update the rates */
+		const scan_stats& sample();
+		const scan_stats& stats() const noexcept { return m_stats; }
+
+		/** Smoothed rates in bytes per second, 0 if no scan is running */
+		double scan_rate() const noexcept { return m_scan_rate; }
+		double issue_rate() const noexcept { return m_issue_rate; }
+		/** Fraction of the data verified so far, from 0 to 1 */
+		double progress() const noexcept;
+		/** Estimated time until the scan completes at the current issue rate, seconds::max() if unknown */
+		std::chrono::seconds eta() const noexcept;
+
+		void start(scan_function fn = scan_function::scrub);
+		void pause();
+		void cancel();
+	};
+
+	/** Copies share the zfs_handle, use detach() for a private one */
 	class dataset {
 		zfs* m_parent{};
-		zfs_handle* m_hdl{};
+		std::shared_ptr<zfs_handle> m_hdl;
 
 	public:
-		dataset(zfs& parent, zfs_handle* hdl) : m_parent(&parent), m_hdl(hdl) {}
-		dataset(dataset&& other) : m_parent(other.m_parent), m_hdl(other.m_hdl) {
-			other.m_parent = nullptr;
-			other.m_hdl = nullptr;
-		}
-		dataset& operator=(dataset&& other);
-		dataset(const dataset&);
-		dataset& operator=(const dataset&);
-		~dataset();
+		/** An invalid handle, see valid() */
+		dataset() noexcept = default;
+		dataset(zfs& parent, zfs_handle* hdl);
+		dataset(dataset&& other) = default;
+		dataset& operator=(dataset&& other) = default;
+		dataset(const dataset&) = default;
+		dataset& operator=(const dataset&) = default;
+		~dataset() = default;
 
 		bool valid() const noexcept { return m_hdl != nullptr; }
 		operator bool() const noexcept { return valid(); }
 		bool operator!() const noexcept { return !valid(); }
 
-		zfs_handle* raw() const noexcept { return m_hdl; }
+		zfs_handle* raw() const noexcept { return m_hdl.get(); }
 
 		zfs& client() noexcept { return *m_parent; }
 		const zfs& client() const noexcept { return *m_parent; }
 
+		void detach();
+		void refresh();
+
 		std::string name() const noexcept;
 		std::string relative_name() const noexcept;
 		pool parent_pool() const noexcept;
@@ -338,6 +937,14 @@ namespace zfspp {
 		nv_list user_properties() const;
 		void set_property(const char* name, const char* value);
 
+		uint64_t send_space(const send_options& options = {}) const;
+		send_progress send(int fd, const send_options& options = {});
+		receive_stats receive(int fd, const receive_options& options = {});
+		std::string receive_resume_token() const;
+
+		void diff(const std::string& from, const std::string& to,
+				  const std::function<void(const diff_record&)>& cb) const;
+
 		dataset create_snapshot(const char* name, bool recursive = false, const nv_list& opts = {});
 		dataset create_child(const char* name, dataset_type type = dataset_type::filesystem, const nv_list& opts = {});
 		dataset clone(const char* name, const nv_list& opts = {});
@@ -347,18 +954,257 @@ namespace zfspp {
 		void unmount(bool force = false);
 	};
 
+	/** Matches if every kind of criteria added matches, events lacking a filtered field do not */
+	class event_filter {
+		struct node {
+			std::vector<std::pair<char, uint32_t>> children;
+			bool exact{false};
+			bool prefix{false};
+		};
+
+		// Class patterns are compiled into a trie, so matching walks the class name once
+		std::vector<node> m_classes;
+		std::set<uint64_t> m_pool_guids;
+		std::set<std::string, std::less<>> m_pool_names;
+		std::set<uint64_t> m_vdev_guids;
+
+		bool match_class(const char* cls) const noexcept;
+
+	public:
+		/** Matches the class exactly, or every class starting with it if the pattern ends in '*' */
+		event_filter& add_class(std::string_view pattern);
+		event_filter& add_pool(uint64_t guid);
+		event_filter& add_pool(const std::string& name);
+		event_filter& add_vdev(uint64_t guid);
+
+		bool empty() const noexcept;
+		/** Evaluated on the raw event, nothing is copied */
+		bool matches(::nvlist* event) const noexcept;
+	};
+
+	/** Known zevent classes, ereport.fs.zfs.*, resource.fs.zfs.* and sysevent.fs.zfs.* */
+	enum class zevent_type {
+		unknown,
+		ereport_authentication,
+		ereport_checksum,
+		ereport_config_cache_write,
+		ereport_data,
+		ereport_deadman,
+		ereport_delay,
+		ereport_io,
+		ereport_io_failure,
+		ereport_log_replay,
+		ereport_probe_failure,
+		/** Any of the ereport.fs.zfs.vdev.* classes */
+		ereport_vdev,
+		ereport_zpool,
+		resource_autoreplace,
+		resource_removed,
+		resource_statechange,
+		sysevent_bootfs_vdev_attach,
+		sysevent_config_sync,
+		sysevent_history_event,
+		sysevent_initialize_cancel,
+		sysevent_initialize_finish,
+		sysevent_initialize_resume,
+		sysevent_initialize_start,
+		sysevent_initialize_suspend,
+		sysevent_pool_create,
+		sysevent_pool_destroy,
+		sysevent_pool_export,
+		sysevent_pool_import,
+		sysevent_pool_reguid,
+		sysevent_resilver_finish,
+		sysevent_resilver_start,
+		sysevent_scrub_abort,
+		sysevent_scrub_finish,
+		sysevent_scrub_paused,
+		sysevent_scrub_resume,
+		sysevent_scrub_start,
+		sysevent_trim_cancel,
+		sysevent_trim_finish,
+		sysevent_trim_resume,
+		sysevent_trim_start,
+		sysevent_trim_suspend,
+		sysevent_vdev_add,
+		sysevent_vdev_attach,
+		sysevent_vdev_autoexpand,
+		sysevent_vdev_check,
+		sysevent_vdev_clear,
+		sysevent_vdev_online,
+		sysevent_vdev_remove,
+		sysevent_vdev_remove_aux,
+		sysevent_vdev_remove_dev,
+		sysevent_vdev_spare,
+	};
+
+	/** Strings point into the decoded nv_list and are only valid as long as it is */
+	struct zevent {
+		/** Failed I/O, valid for the checksum, data, delay, deadman, io and authentication ereports */
+		struct zio_info {
+			int32_t err;
+			uint64_t objset;
+			uint64_t object;
+			int64_t level;
+			uint64_t blkid;
+			uint64_t offset;
+			uint64_t size;
+		};
+		/** Valid for resource_statechange, the values are vdev_state */
+		struct state_change_info {
+			uint64_t state;
+			uint64_t last_state;
+		};
+		/** Valid for sysevent_history_event */
+		struct history_info {
+			std::string_view hostname;
+			std::string_view dsname;
+			std::string_view internal_name;
+			std::string_view internal_str;
+			uint64_t txg;
+		};
+
+		zevent_type type{zevent_type::unknown};
+		std::string_view class_name;
+		std::string_view pool;
+		uint64_t pool_guid{};
+		uint64_t vdev_guid{};
+		std::string_view vdev_path;
+		std::array<int64_t, 2> time{};
+		uint64_t eid{};
+		/** Selected by type, zero for types without a payload */
+		union {
+			zio_info zio{};
+			state_change_info state_change;
+			history_info history;
+		};
+
+		zevent() noexcept {}
+		explicit zevent(const nv_list& event) noexcept;
+
+		bool is_ereport() const noexcept;
+		bool is_sysevent() const noexcept;
+	};
+
+	/** What the watcher thread does with an event once the handoff queue is full */
+	enum class overflow_policy {
+		/** Wait for a consumer to make room, the kernel queue keeps buffering meanwhile */
+		block,
+		/** Discard the oldest queued event, reported through the drop callback */
+		drop_oldest,
+		/** Keep only the newest held back event per class, pool and vdev, except ereports and history */
+		coalesce
+	};
+
+	/** Bounded lock-free MPMC ring (Vyukov) handing events from the watcher thread to the consumers */
+	class event_queue {
+		using key_type = std::tuple<std::string, uint64_t, uint64_t>;
+
+		struct cell {
+			std::atomic<size_t> seq;
+			nv_list value;
+		};
+
+		std::unique_ptr<cell[]> m_cells;
+		size_t m_mask;
+		alignas(64) std::atomic<size_t> m_head{0};
+		alignas(64) std::atomic<size_t> m_tail{0};
+
+		// Only used to park idle threads, never around the ring itself
+		std::mutex m_park_mtx;
+		std::condition_variable m_has_data;
+		std::condition_variable m_has_space;
+		std::atomic<size_t> m_idle_consumers{0};
+		std::atomic<bool> m_producer_waiting{false};
+		bool m_closed{false};
+
+		// Events held back by overflow_policy::coalesce, only touched by the producer
+		std::list<std::pair<key_type, nv_list>> m_held;
+		std::map<key_type, std::list<std::pair<key_type, nv_list>>::iterator> m_held_index;
+
+		bool try_push(nv_list& value);
+		bool try_pop(nv_list& value);
+		void notify_data();
+		void notify_space();
+		size_t hold(nv_list& value);
+
+	public:
+		/** The capacity is rounded up to the next power of two, but at least two */
+		explicit event_queue(size_t capacity);
+		event_queue(const event_queue&) = delete;
+		event_queue& operator=(const event_queue&) = delete;
+
+		size_t capacity() const noexcept { return m_mask + 1; }
+		bool empty() const noexcept { return m_tail.load() == m_head.load(); }
+		bool full() const noexcept { return m_tail.load() - m_head.load() > m_mask; }
+		/** Number of events held back by overflow_policy::coalesce, not yet in the ring */
+		size_t held() const noexcept { return m_held.size(); }
+
+		/** Returns the number of events dropped or replaced to make room, coalesce allows a single producer */
+		size_t push(nv_list& value, overflow_policy policy, std::chrono::milliseconds timeout);
+		bool pop(nv_list& value);
+		/** Moves held back events into the ring as long as there is room */
+		void flush_held();
+
+		/** Returns false once the queue was closed and everything in it was taken */
+		bool wait_data();
+		/** Like wait_data, but also returns false once the deadline passed without an event */
+		bool wait_data_until(std::chrono::steady_clock::time_point deadline);
+		/** Returns early without space on timeout or if stop is set, the caller rechecks both */
+		void wait_space(std::chrono::milliseconds timeout, const std::atomic<bool>* stop);
+		void wake_producer();
+		void close();
+
+		/** Ereports and history events are records instead of state, a newer one does not replace them */
+		static bool is_coalescible(const nv_list& value) noexcept;
+	};
+
+	/** Delivers zevents to callbacks on consumer threads after start() or from poll() */
 	class event_watcher {
+		using event_callback = std::function<void(const nv_list&)>;
+		using batch_callback = std::function<void(span<const nv_list>)>;
+		using zevent_callback = std::function<void(const zevent&)>;
+		using drop_callback = std::function<void(size_t)>;
+		using error_callback = std::function<void()>;
+
 		zfs* m_parent{};
 		std::thread m_watcher_thread;
+		std::vector<std::thread> m_consumer_threads;
+		std::unique_ptr<event_queue> m_queue;
+		// Serializes start() and stop(), the threads never take it
+		std::mutex m_lifecycle_mtx;
 		mutable std::mutex m_mtx;
 		std::array<uint64_t, 3> m_checkpoint{};
-		std::function<void(const nv_list&)> m_on_event;
-		std::function<void(size_t)> m_on_drop;
-		std::function<void()> m_on_error;
-		bool m_should_stop{};
-		bool m_is_started{false};
+		// Swapped atomically so they can be replaced while running without locking around the calls
+		std::shared_ptr<const event_callback> m_on_event;
+		std::shared_ptr<const batch_callback> m_on_events;
+		std::shared_ptr<const zevent_callback> m_on_zevent;
+		std::shared_ptr<const drop_callback> m_on_drop;
+		std::shared_ptr<const error_callback> m_on_error;
+		std::shared_ptr<const event_filter> m_filter;
+		struct state_file;
+		std::mutex m_state_mtx;
+		std::unique_ptr<state_file> m_state;
+		std::chrono::milliseconds m_poll_interval{100};
+		size_t m_queue_capacity{1024};
+		overflow_policy m_overflow{overflow_policy::block};
+		size_t m_consumers{1};
+		size_t m_max_batch{1};
+		std::chrono::milliseconds m_max_latency{0};
+		int m_wakefd{-1};
+		std::atomic<bool> m_should_stop{false};
+		std::atomic<bool> m_is_started{false};
+		bool m_replaying{true};
+		bool m_durable{false};
 
 		void thread_fn();
+		void consumer_fn();
+		void shutdown() noexcept;
+		bool read_event(nv_list& info);
+		void deliver(span<const nv_list> batch);
+		void report_drop(size_t count);
+		void report_error();
+		void persist_checkpoint(bool force);
 
 	public:
 		event_watcher(zfs& parent);
@@ -368,22 +1214,231 @@ namespace zfspp {
 		event_watcher& operator=(event_watcher&&) = delete;
 		~event_watcher();
 
+		/** Events up to and including this checkpoint are skipped until the first newer one was seen */
 		void set_checkpoint(std::array<uint64_t, 3> checkpoint);
 		std::array<uint64_t, 3> checkpoint() const noexcept;
+		/** Persist the checkpoint and resume from it, requires a single consumer thread */
+		void set_checkpoint_file(const std::string& path,
+								 std::chrono::milliseconds sync_interval = std::chrono::seconds(1));
+		/** Write the current checkpoint to the state file now */
+		void sync_checkpoint();
 
 		void set_on_event(std::function<void(const nv_list&)> cb);
+		/** Called with the decoded event, before the on_event callback if both are set */
+		void set_on_zevent(std::function<void(const zevent&)> cb);
+		/** Takes precedence over set_on_event and set_on_zevent, the checkpoint then advances once per batch */
+		void set_on_events(std::function<void(span<const nv_list>)> cb);
 		void set_on_drop(std::function<void(size_t)> cb);
 		void set_on_error(std::function<void()> cb);
+		/** Events not matching the filter are discarded by the watcher thread before they are queued */
+		void set_filter(event_filter filter);
+		/** Time the watcher thread sleeps once the queue is empty, bounds the delivery latency */
+		void set_poll_interval(std::chrono::milliseconds interval);
+		/** Size of the handoff queue (rounded up to a power of two) and what happens once it is full */
+		void set_queue(size_t capacity, overflow_policy policy = overflow_policy::block);
+		/** Number of threads running the callbacks, only one keeps the events in order */
+		void set_consumer_threads(size_t count);
+		/** A consumer waits at most max_latency after the first event of a batch for more */
+		void set_batching(size_t max_size, std::chrono::milliseconds max_latency = {});
 
 		void start();
+		/** Stops reading, consumers deliver what is already queued first. Also syncs the checkpoint file */
 		void stop();
+		/** Deliver every queued event on the calling thread, returns their number. Not allowed after start() */
+		size_t poll();
+	};
+
+	struct dataset_cache_stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t invalidations;
+		size_t size;
+		size_t capacity;
+	};
+
+	/** LRU cache of dataset handles, feed it zevents with handle_event() or call invalidate() */
+	class dataset_cache {
+		using key_type = std::pair<std::string, dataset_type>;
+		using entry_type = std::pair<key_type, dataset>;
+		using open_function = std::function<dataset(const std::string&, dataset_type)>;
+
+		open_function m_open;
+		mutable std::mutex m_mtx;
+		size_t m_capacity;
+		std::list<entry_type> m_lru;
+		std::map<key_type, std::list<entry_type>::iterator> m_index;
+		dataset_cache_stats m_stats{};
+		// Bumped by every invalidation, a handle opened across one might be stale and is not cached
+		uint64_t m_generation{0};
+
+		void trim(std::vector<dataset>& evicted);
+
+	public:
+		dataset_cache(zfs& parent, size_t capacity = 1024);
+		/** Misses are opened by fn, which is called without holding the cache lock */
+		dataset_cache(open_function fn, size_t capacity = 1024);
+		dataset_cache(const dataset_cache&) = delete;
+		dataset_cache(dataset_cache&&) = delete;
+		dataset_cache& operator=(const dataset_cache&) = delete;
+		dataset_cache& operator=(dataset_cache&&) = delete;
+		~dataset_cache();
+
+		dataset open(const std::string& name, dataset_type dt = dataset_type::any);
+
+		void invalidate(const std::string& name, bool recursive = true);
+		void handle_event(const nv_list& event);
+		void clear();
+
+		void set_capacity(size_t capacity);
+		dataset_cache_stats stats() const noexcept;
+		void reset_stats() noexcept;
+	};
+
+	/** Lexically resolves absolute paths to the mounted dataset using a trie built from /proc/self/mountinfo */
+	class mount_resolver {
+		struct node {
+			std::map<std::string, std::unique_ptr<node>, std::less<>> children;
+			std::string dataset;
+			bool mounted{false};
+		};
+
+		mutable std::mutex m_mtx;
+		node m_root;
+		std::map<std::string, std::string> m_mounts;
+		std::string m_buffer;
+		std::string m_previous;
+		int m_fd{-1};
+
+		void insert(const std::string& mountpoint, const std::string& dataset);
+		void erase(const std::string& mountpoint);
+		void apply_buffer();
+
+	public:
+		mount_resolver();
+		/** Builds the table from mountinfo content instead of /proc/self/mountinfo, fd() is -1 */
+		explicit mount_resolver(std::string_view mountinfo);
+		mount_resolver(const mount_resolver&) = delete;
+		mount_resolver(mount_resolver&&) = delete;
+		mount_resolver& operator=(const mount_resolver&) = delete;
+		mount_resolver& operator=(mount_resolver&&) = delete;
+		~mount_resolver();
+
+		int fd() const noexcept { return m_fd; }
+
+		/** Rereads the whole mount table, only mounts that changed are updated in the trie */
+		void refresh();
+		/** Calls refresh() if fd() signals a mount table change with POLLPRI */
+		bool refresh_if_changed();
+		/** Replaces the table with mountinfo content, updating the trie like refresh() */
+		void update(std::string_view mountinfo);
+
+		bool resolve(const std::string& path, std::string& dataset, std::string* mountpoint = nullptr) const;
+		size_t size() const noexcept;
+	};
+
+	struct replication_task {
+		/** Full name of the snapshot to replicate */
+		std::string source;
+		/** Incremental source snapshot or bookmark, empty for a full stream */
+		std::string from;
+		/** Name of the receiving dataset */
+		std::string target;
+		/** Link the stream is sent over, empty to receive locally */
+		std::string link;
+	};
+
+	struct replication_result {
+		replication_task task;
+		/** Size reported by lzc_send_space, 0 if it could not be estimated */
+		uint64_t estimated_size;
+		/** Bytes written by the last attempt */
+		uint64_t bytes_sent;
+		/** The stream was resumed from a receive_resume_token */
+		bool resumed;
+		/** Error of the last attempt, empty on success */
+		std::exception_ptr error;
+	};
+
+	struct replication_link {
+		size_t max_concurrency{1};
+		/** Returns an fd to the receiver, which has to receive with -s for resumable streams */
+		std::function<int(const replication_task&)> connect;
+		/** Called after the stream was written and the fd closed, throw to report a failed receive */
+		std::function<void(const replication_task&)> complete;
+		/** Return the receive_resume_token of the remote target, empty if there is none */
+		std::function<std::string(const replication_task&)> resume_token;
+		/** Discard the partial receive of the remote target (zfs receive -A), used for tokens of other streams */
+		std::function<void(const replication_task&)> abort_resume;
+	};
+
+	struct replication_options {
+		size_t max_concurrency{4};
+		/** Maximum number of streams per source pool (and target pool for local receives), 0 for no limit */
+		size_t max_per_pool{2};
+		/** Additional attempts for a task that failed with a resume token available */
+		size_t retries{1};
+		send_options send;
+		/** Options for local receives, resumable is always set */
+		receive_options receive;
+		/** File the resume tokens of interrupted tasks are kept in between runs, empty to keep them in memory */
+		std::string state_file;
+		/** Called from the worker threads, possibly concurrently */
+		std::function<void(const replication_task&, const send_progress&)> on_progress;
+	};
+
+	/** Replicates snapshots largest first with bounded concurrency, resuming interrupted streams */
+	class replication_job {
+		replication_options m_options;
+		std::vector<replication_task> m_tasks;
+		std::map<std::string, replication_link> m_links;
+		std::mutex m_state_mtx;
+		std::map<std::string, std::string> m_tokens;
+
+		void load_state();
+		void save_state();
+		void set_token(const std::string& target, const std::string& token);
+		std::string query_token(zfs& client, const replication_task& task);
+		void abort_resume(zfs& client, const replication_task& task);
+		send_progress stream(zfs& send_client, zfs& recv_client, const replication_task& task,
+							 const std::string& token, const send_options& options);
+		void run_task(zfs& send_client, zfs& recv_client, replication_result& result);
+
+	public:
+		replication_job(replication_options options = {});
+		replication_job(const replication_job&) = delete;
+		replication_job(replication_job&&) = delete;
+		replication_job& operator=(const replication_job&) = delete;
+		replication_job& operator=(replication_job&&) = delete;
+		~replication_job() = default;
+
+		void add_link(const std::string& name, replication_link link);
+		void add(replication_task task);
+
+		std::vector<replication_result> run();
 	};
 
 	const std::error_category& zfs_category() noexcept;
 
+	retention_plan plan_retention(const retention_policy& policy, const std::vector<snapshot_info>& snapshots);
+
+	/** Built-in programs for pool::run_channel_program(), name sets are nvlists keyed by name */
+	namespace channel_programs {
+		/** Snapshots of args.dataset (recursive with args.recursive) with args.properties */
+		extern const char* const list_snapshots;
+		/** The properties listed in args.properties of every dataset in args.datasets */
+		extern const char* const get_properties;
+		/** Destroys unheld snapshots in args.snapshots, returns the others with their errno */
+		extern const char* const destroy_unheld_snapshots;
+	} // namespace channel_programs
+
 	constexpr inline dataset_type operator|(dataset_type lhs, dataset_type rhs) noexcept {
 		return static_cast<dataset_type>(static_cast<size_t>(lhs) | static_cast<size_t>(rhs));
 	}
 
+	constexpr inline import_flags operator|(import_flags lhs, import_flags rhs) noexcept {
+		return static_cast<import_flags>(static_cast<int>(lhs) | static_cast<int>(rhs));
+	}
+
 	const char* nv_type_name(nv_type dt) noexcept;
 } // namespace zfspp
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "zfspp.h"
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <libzfs_core.h>
+
+namespace zfspp {
+
+	namespace {
+		// Keeps the nvlist passed to the kernel well below zfs_max_nvlist_src_size
+		constexpr size_t batch_size = 8192;
+
+		std::string_view pool_of(std::string_view name) { return name.substr(0, name.find_first_of("/@#")); }
+
+		/**
+		 * Issue an lzc call once per pool and batch of keys, the kernel rejects requests that span pools.
+		 * Most of these calls are atomic, a single failing entry fails the whole batch. Entries reported in the
+		 * error list are therefore dropped and the rest is retried, so only the failing entries end up in the
+		 * result. Holds and releases skip missing snapshots instead and only list them, even on success.
+		 */
+		template<typename TAdd, typename TCall>
+		std::map<std::string, std::error_code> for_each_pool_batch(const std::vector<std::string>& keys, TAdd&& add,
+																	 TCall&& call) {
+			std::map<std::string_view, std::vector<const std::string*>> pools;
+			for (auto& e : keys)
+				pools[pool_of(e)].push_back(&e);
+
+			std::map<std::string, std::error_code> errors;
+			for (auto& pool : pools) {
+				auto& list = pool.second;
+				for (size_t offset = 0; offset < list.size(); offset += batch_size) {
+					nv_list batch;
+					for (size_t i = offset; i < list.size() && i < offset + batch_size; i++)
+						add(batch, *list[i]);
+
+					while (!batch.empty()) {
+						::nvlist* errlist{};
+						auto err = call(batch, &errlist);
+						nv_list failed{errlist, nv_list::adopt_list{}};
+						size_t removed = 0;
+						for (auto& e : failed) {
+							auto name = e.key();
+							if (!batch.erase(name.c_str())) continue;
+							errors[name] = std::error_code(e.as_int32(), std::system_category());
+							removed++;
+						}
+						if (err == 0) break;
+						if (removed != 0) continue;
+						for (auto& e : batch)
+							errors[e.key()] = std::error_code(err, std::system_category());
+						break;
+					}
+				}
+			}
+			return errors;
+		}
+	} // namespace
+
+	std::map<std::string, std::error_code> zfs::destroy_snapshots(const std::vector<std::string>& names, bool defer) {
+		return for_each_pool_batch(
+			names, [](nv_list& batch, const std::string& name) { batch.add_boolean(name.c_str()); },
+			[defer](nv_list& batch, ::nvlist** errlist) {
+				return lzc_destroy_snaps(batch.raw(), defer ? B_TRUE : B_FALSE, errlist);
+			});
+	}
+
+	std::map<std::string, std::error_code>
+	zfs::create_bookmarks(const std::map<std::string, std::string>& snapshot_to_bookmark) {
+		std::map<std::string, const std::string*> sources;
+		std::vector<std::string> bookmarks;
+		bookmarks.reserve(snapshot_to_bookmark.size());
+		for (auto& e : snapshot_to_bookmark) {
+			if (e.second.find('#') == std::string::npos) throw std::invalid_argument("not a bookmark: " + e.second);
+			if (!sources.emplace(e.second, &e.first).second)
+				throw std::invalid_argument("duplicate bookmark: " + e.second);
+			bookmarks.push_back(e.second);
+		}
+		return for_each_pool_batch(
+			bookmarks,
+			[&](nv_list& batch, const std::string& name) { batch.add_string(name.c_str(), sources[name]->c_str()); },
+			[](nv_list& batch, ::nvlist** errlist) { return lzc_bookmark(batch.raw(), errlist); });
+	}
+
+	std::map<std::string, std::error_code> zfs::hold(const std::vector<std::string>& snapshots, const std::string& tag,
+													 int cleanup_fd) {
+		return for_each_pool_batch(
+			snapshots, [&](nv_list& batch, const std::string& name) { batch.add_string(name.c_str(), tag.c_str()); },
+			[cleanup_fd](nv_list& batch, ::nvlist** errlist) { return lzc_hold(batch.raw(), cleanup_fd, errlist); });
+	}
+
+	std::map<std::string, std::error_code> zfs::release(const std::vector<std::string>& snapshots,
+														const std::string& tag) {
+		nv_list tags;
+		tags.add_boolean(tag.c_str());
+		return for_each_pool_batch(
+			snapshots, [&](nv_list& batch, const std::string& name) { batch.add_nvlist(name.c_str(), tags); },
+			[](nv_list& batch, ::nvlist** errlist) { return lzc_release(batch.raw(), errlist); });
+	}
+
+	std::map<std::string, std::map<std::string, uint64_t>> zfs::holds(const std::vector<std::string>& snapshots) {
+		// There is no bulk ioctl for this, but unlike libzfs no handle is opened per snapshot
+		std::map<std::string, std::map<std::string, uint64_t>> res;
+		for (auto& e : snapshots) {
+			::nvlist* list{};
+			auto err = lzc_get_holds(e.c_str(), &list);
+			if (err == ENOENT) continue;
+			if (err != 0) throw std::system_error(err, std::system_category());
+			nv_list holds{list, nv_list::adopt_list{}};
+			auto& tags = res[e];
+			for (auto& tag : holds)
+				tags.emplace(tag.key(), tag.as_uint64());
+		}
+		return res;
+	}
+
+} // namespace zfspp
@@ -0,0 +1,89 @@
+#include "zfspp.h"
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <libzfs_core.h>
+#include <sys/nvpair.h>
+
+namespace zfspp {
+
+	namespace channel_programs {
+		const char* const list_snapshots = R"lua(
+local args = ...
+local props = args["properties"] or {}
+local result = {}
+local function visit(fs)
+	for snap in zfs.list.snapshots(fs) do
+		local entry = {}
+		for prop, _ in pairs(props) do
+			local value = zfs.get_prop(snap, prop)
+			if value ~= nil then entry[prop] = value end
+		end
+		result[snap] = entry
+	end
+	if args["recursive"] then
+		for child in zfs.list.children(fs) do visit(child) end
+	end
+end
+visit(args["dataset"])
+return result
+)lua";
+
+		const char* const get_properties = R"lua(
+local args = ...
+local props = args["properties"] or {}
+local result = {}
+for ds, _ in pairs(args["datasets"]) do
+	local entry = {}
+	for prop, _ in pairs(props) do
+		local value = zfs.get_prop(ds, prop)
+		if value ~= nil then entry[prop] = value end
+	end
+	result[ds] = entry
+end
+return result
+)lua";
+
+		const char* const destroy_unheld_snapshots = R"lua(
+local args = ...
+local failed = {}
+for snap, _ in pairs(args["snapshots"]) do
+	if zfs.get_prop(snap, "userrefs") == 0 then
+		local err = zfs.sync.destroy(snap)
+		if err ~= 0 then failed[snap] = err end
+	else
+		failed[snap] = 16
+	end
+end
+return failed
+)lua";
+	} // namespace channel_programs
+
+	nv_list pool::run_channel_program(const std::string& program, const nv_list& args,
+									  const channel_program_limits& limits, bool sync) {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		auto poolname = name();
+
+		// The kernel requires an argument list, even if it is empty
+		nv_list empty;
+		auto argnvl = args.raw();
+		if (argnvl == nullptr) {
+			if (nvlist_alloc(&argnvl, NV_UNIQUE_NAME, 0) != 0) throw std::bad_alloc();
+			empty = nv_list{argnvl, nv_list::adopt_list{}};
+		}
+
+		::nvlist* out{};
+		auto fn = sync ? &lzc_channel_program : &lzc_channel_program_nosync;
+		auto err = fn(poolname.c_str(), program.c_str(), limits.instructions, limits.memory, argnvl, &out);
+		nv_list result{out, nv_list::adopt_list{}};
+		if (err != 0) {
+			char* msg{};
+			if (out != nullptr && nvlist_lookup_string(out, "error", &msg) == 0)
+				throw std::system_error(err, std::system_category(), msg);
+			throw std::system_error(err, std::system_category());
+		}
+		return result;
+	}
+
+} // namespace zfspp
@@ -21,10 +21,11 @@ namespace zfspp {
 				zfs_close(hdl);
 			} else {
 				try {
-					ptr->result.emplace_back(ptr->parent, hdl);
+					// Once constructed the dataset owns hdl and releases it on failure
+					dataset ds{ptr->parent, hdl};
+					ptr->result.push_back(std::move(ds));
 				} catch (...) {
 					ptr->alloc_failed = true;
-					zfs_close(hdl);
 				}
 			}
 			return 0;
@@ -53,37 +54,40 @@ namespace zfspp {
 		return dataset(*this, hdl);
 	}
 
-	dataset& dataset::operator=(dataset&& other) {
-		if (m_hdl) zfs_close(m_hdl);
-		m_parent = other.m_parent;
-		m_hdl = other.m_hdl;
-		other.m_parent = nullptr;
-		other.m_hdl = nullptr;
-		return *this;
-	}
+	namespace {
+		std::shared_ptr<zfs_handle> make_handle(zfs& parent, zfs_handle* hdl) {
+			// If allocating the control block fails the deleter is invoked, so the handle never leaks
+			auto client = &parent;
+			return std::shared_ptr<zfs_handle>(hdl, [client](zfs_handle* ptr) {
+				if (ptr == nullptr) return;
+				std::unique_lock<zfs> lck{*client};
+				zfs_close(ptr);
+			});
+		}
+	} // namespace
 
-	dataset::dataset(const dataset& other) : m_parent(other.m_parent), m_hdl(nullptr) {
-		std::unique_lock<zfs> lck{*other.m_parent};
-		if (other.m_hdl) m_hdl = zfs_handle_dup(other.m_hdl);
-	}
+	dataset::dataset(zfs& parent, zfs_handle* hdl) : m_parent(&parent), m_hdl(make_handle(parent, hdl)) {}
 
-	dataset& dataset::operator=(const dataset& other) {
-		std::unique_lock<zfs> lck{*other.m_parent};
-		if (m_hdl) zfs_close(m_hdl);
-		m_hdl = nullptr;
-		m_parent = other.m_parent;
-		if (other.m_hdl) m_hdl = zfs_handle_dup(other.m_hdl);
-		return *this;
+	void dataset::detach() {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
+		if (m_hdl.use_count() == 1) return;
+		std::unique_lock<zfs> lck{*m_parent};
+		auto hdl = zfs_handle_dup(m_hdl.get());
+		if (hdl == nullptr) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		m_hdl = make_handle(*m_parent, hdl);
 	}
 
-	dataset::~dataset() {
+	void dataset::refresh() {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
 		std::unique_lock<zfs> lck{*m_parent};
-		if (m_hdl) zfs_close(m_hdl);
+		auto hdl = zfs_open(m_parent->raw(), zfs_get_name(m_hdl.get()), zfs_get_type(m_hdl.get()));
+		if (hdl == nullptr) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		m_hdl = make_handle(*m_parent, hdl);
 	}
 
 	std::string dataset::name() const noexcept {
 		std::unique_lock<zfs> lck{*m_parent};
-		return zfs_get_name(m_hdl);
+		return zfs_get_name(m_hdl.get());
 	}
 
 	std::string dataset::relative_name() const noexcept {
@@ -98,23 +102,23 @@ namespace zfspp {
 
 	pool dataset::parent_pool() const noexcept {
 		std::unique_lock<zfs> lck{*m_parent};
-		return {*m_parent, zfs_get_pool_handle(m_hdl)};
+		return {*m_parent, zfs_get_pool_handle(m_hdl.get())};
 	}
 
 	std::string dataset::pool_name() const noexcept {
 		std::unique_lock<zfs> lck{*m_parent};
-		return zfs_get_pool_name(m_hdl);
+		return zfs_get_pool_name(m_hdl.get());
 	}
 
 	dataset_type dataset::type() const noexcept {
 		std::unique_lock<zfs> lck{*m_parent};
-		return static_cast<dataset_type>(zfs_get_type(m_hdl));
+		return static_cast<dataset_type>(zfs_get_type(m_hdl.get()));
 	}
 
 	std::string dataset::mountpoint() const noexcept {
 		std::unique_lock<zfs> lck{*m_parent};
 		char* ptr{nullptr};
-		if (zfs_is_mounted(m_hdl, &ptr) == B_FALSE) return "";
+		if (zfs_is_mounted(m_hdl.get(), &ptr) == B_FALSE) return "";
 		std::string res{ptr};
 		free(ptr);
 		return res;
@@ -123,7 +127,7 @@ namespace zfspp {
 	std::vector<dataset> dataset::children() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_children(m_hdl, iterate_data::cb, &data);
+		zfs_iter_children(m_hdl.get(), iterate_data::cb, &data);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
@@ -131,7 +135,7 @@ namespace zfspp {
 	std::vector<dataset> dataset::filesystems() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_filesystems(m_hdl, iterate_data::cb, &data);
+		zfs_iter_filesystems(m_hdl.get(), iterate_data::cb, &data);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
@@ -139,7 +143,7 @@ namespace zfspp {
 	std::vector<dataset> dataset::snapshots() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_snapshots(m_hdl, B_FALSE, iterate_data::cb, &data, 0, 0);
+		zfs_iter_snapshots(m_hdl.get(), B_FALSE, iterate_data::cb, &data, 0, 0);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
@@ -147,7 +151,7 @@ namespace zfspp {
 	std::vector<dataset> dataset::snapshots_sorted() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_snapshots_sorted(m_hdl, iterate_data::cb, &data, 0, 0);
+		zfs_iter_snapshots_sorted(m_hdl.get(), iterate_data::cb, &data, 0, 0);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
@@ -155,7 +159,7 @@ namespace zfspp {
 	std::vector<dataset> dataset::bookmarks() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_bookmarks(m_hdl, iterate_data::cb, &data);
+		zfs_iter_bookmarks(m_hdl.get(), iterate_data::cb, &data);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
@@ -163,28 +167,28 @@ namespace zfspp {
 	std::vector<dataset> dataset::mounted_children() const {
 		std::unique_lock<zfs> lck{*m_parent};
 		iterate_data data{*m_parent};
-		zfs_iter_mounted(m_hdl, iterate_data::cb, &data);
+		zfs_iter_mounted(m_hdl.get(), iterate_data::cb, &data);
 		if (data.alloc_failed) throw std::bad_alloc();
 		return std::move(data.result);
 	}
 
 	nv_list dataset::properties() const {
 		std::unique_lock<zfs> lck{*m_parent};
-		auto res = zfs_get_all_props(m_hdl);
+		auto res = zfs_get_all_props(m_hdl.get());
 		if (res == nullptr) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 		return nv_list{res};
 	}
 
 	nv_list dataset::user_properties() const {
 		std::unique_lock<zfs> lck{*m_parent};
-		auto res = zfs_get_user_props(m_hdl);
+		auto res = zfs_get_user_props(m_hdl.get());
 		if (res == nullptr) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 		return nv_list{res};
 	}
 
 	void dataset::set_property(const char* name, const char* value) {
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_prop_set(m_hdl, name, value) != 0)
+		if (zfs_prop_set(m_hdl.get(), name, value) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 	}
 
@@ -214,7 +218,7 @@ namespace zfspp {
 
 	dataset dataset::clone(const char* name, const nv_list& opts) {
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_clone(m_hdl, name, opts.raw()) != 0)
+		if (zfs_clone(m_hdl.get(), name, opts.raw()) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 		return m_parent->open_dataset(name, type());
 	}
@@ -222,28 +226,28 @@ namespace zfspp {
 	void dataset::destroy(bool defer) {
 		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_destroy(m_hdl, defer ? B_TRUE : B_FALSE) != 0)
+		if (zfs_destroy(m_hdl.get(), defer ? B_TRUE : B_FALSE) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 	}
 
 	void dataset::mount(const std::string& options, int flags) {
 		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_mount(m_hdl, options.c_str(), flags) != 0)
+		if (zfs_mount(m_hdl.get(), options.c_str(), flags) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 	}
 
 	void dataset::mount_at(const std::string& mountpoint, const std::string& options, int flags) {
 		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_mount_at(m_hdl, options.c_str(), flags, mountpoint.c_str()) != 0)
+		if (zfs_mount_at(m_hdl.get(), options.c_str(), flags, mountpoint.c_str()) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 	}
 
 	void dataset::unmount(bool force) {
 		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
 		std::unique_lock<zfs> lck{*m_parent};
-		if (zfs_unmountall(m_hdl, force ? MS_FORCE : 0) != 0)
+		if (zfs_unmountall(m_hdl.get(), force ? MS_FORCE : 0) != 0)
 			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
 	}
 
@@ -0,0 +1,163 @@
+#include "zfspp.h"
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <sys/nvpair.h>
+
+namespace zfspp {
+
+	namespace {
+		bool is_descendant_or_self(const std::string& name, const std::string& root) {
+			if (name.compare(0, root.size(), root) != 0) return false;
+			if (name.size() == root.size()) return true;
+			auto c = name[root.size()];
+			return c == '/' || c == '@' || c == '#';
+		}
+
+		// History operations which invalidate cached properties or names of the dataset they are logged for
+		constexpr const char* invalidating_operations[] = {
+			"destroy", "rename", "set", "inherit", "promote", "rollback", "receive", "finish receiving", "clone swap",
+			"snapshot", "clone",
+		};
+	} // namespace
+
+	dataset_cache::dataset_cache(zfs& parent, size_t capacity)
+		: dataset_cache([&parent](const std::string& name, dataset_type dt) { return parent.open_dataset(name, dt); },
+						capacity) {}
+
+	dataset_cache::dataset_cache(open_function fn, size_t capacity) : m_open(std::move(fn)), m_capacity(capacity) {
+		if (!m_open) throw std::invalid_argument("open function must not be empty");
+		if (capacity == 0) throw std::invalid_argument("capacity must be greater than zero");
+	}
+
+	dataset_cache::~dataset_cache() { clear(); }
+
+	void dataset_cache::trim(std::vector<dataset>& evicted) {
+		while (m_lru.size() > m_capacity) {
+			auto& e = m_lru.back();
+			evicted.push_back(std::move(e.second));
+			m_index.erase(e.first);
+			m_lru.pop_back();
+			m_stats.evictions++;
+		}
+	}
+
+	dataset dataset_cache::open(const std::string& name, dataset_type dt) {
+		key_type key{name, dt};
+		uint64_t generation;
+		{
+			std::unique_lock<std::mutex> lck{m_mtx};
+			auto it = m_index.find(key);
+			if (it != m_index.end()) {
+				m_lru.splice(m_lru.begin(), m_lru, it->second);
+				m_stats.hits++;
+				return it->second->second;
+			}
+			m_stats.misses++;
+			generation = m_generation;
+		}
+
+		// Opening is done without holding the cache lock, so a slow ioctl does not block hits
+		auto ds = m_open(name, dt);
+
+		std::vector<dataset> evicted;
+		std::unique_lock<std::mutex> lck{m_mtx};
+		auto it = m_index.find(key);
+		if (it != m_index.end()) {
+			// Another thread won the race, hand out its handle instead
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			return it->second->second;
+		}
+		// The dataset changed while it was opened, e.g. renamed or rolled back, so the handle is only returned
+		if (m_generation != generation) return ds;
+		m_lru.emplace_front(key, ds);
+		try {
+			m_index.emplace(std::move(key), m_lru.begin());
+		} catch (...) {
+			m_lru.pop_front();
+			throw;
+		}
+		trim(evicted);
+		return ds;
+	}
+
+	void dataset_cache::invalidate(const std::string& name, bool recursive) {
+		// Closing a handle takes the client lock, so the handles are only released after unlocking
+		std::vector<dataset> evicted;
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_generation++;
+		auto it = m_index.lower_bound(key_type{name, static_cast<dataset_type>(0)});
+		while (it != m_index.end() && it->first.first.compare(0, name.size(), name) == 0) {
+			if ((recursive && is_descendant_or_self(it->first.first, name)) || it->first.first == name) {
+				evicted.push_back(std::move(it->second->second));
+				m_lru.erase(it->second);
+				it = m_index.erase(it);
+				m_stats.invalidations++;
+			} else
+				++it;
+		}
+	}
+
+	void dataset_cache::handle_event(const nv_list& event) {
+		auto raw = event.raw();
+		if (raw == nullptr) return;
+		char* cls{};
+		if (nvlist_lookup_string(raw, "class", &cls) != 0) return;
+
+		char* name{};
+		if (strcmp(cls, "sysevent.fs.zfs.history_event") == 0) {
+			char* op{};
+			if (nvlist_lookup_string(raw, "history_dsname", &name) != 0) return;
+			if (nvlist_lookup_string(raw, "history_internal_name", &op) != 0) return;
+			for (auto e : invalidating_operations) {
+				if (strcmp(op, e) != 0) continue;
+				invalidate(name);
+				// Snapshot and clone are logged on the new dataset, but change the parent's properties
+				std::string parent{name};
+				auto pos = parent.find_last_of("@/");
+				if ((strcmp(op, "snapshot") == 0 || strcmp(op, "clone") == 0) && pos != std::string::npos) {
+					parent.resize(pos);
+					invalidate(parent, false);
+				}
+				break;
+			}
+		} else if (strcmp(cls, "sysevent.fs.zfs.pool_destroy") == 0 ||
+				   strcmp(cls, "sysevent.fs.zfs.pool_export") == 0) {
+			if (nvlist_lookup_string(raw, "pool_name", &name) != 0) return;
+			invalidate(name);
+		}
+	}
+
+	void dataset_cache::clear() {
+		decltype(m_lru) evicted;
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_generation++;
+		m_stats.invalidations += m_lru.size();
+		m_index.clear();
+		evicted.swap(m_lru);
+	}
+
+	void dataset_cache::set_capacity(size_t capacity) {
+		if (capacity == 0) throw std::invalid_argument("capacity must be greater than zero");
+		std::vector<dataset> evicted;
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_capacity = capacity;
+		trim(evicted);
+	}
+
+	dataset_cache_stats dataset_cache::stats() const noexcept {
+		std::unique_lock<std::mutex> lck{m_mtx};
+		auto res = m_stats;
+		res.size = m_lru.size();
+		res.capacity = m_capacity;
+		return res;
+	}
+
+	void dataset_cache::reset_stats() noexcept {
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_stats = {};
+	}
+
+} // namespace zfspp
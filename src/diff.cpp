@@ -0,0 +1,248 @@
+#include "zfspp.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+#include <sys/zfs_ioctl.h>
+
+namespace zfspp {
+
+	namespace {
+		void copy_name(char* dst, size_t size, const std::string& name) {
+			if (name.size() >= size) throw std::system_error(EZFS_NAMETOOLONG, zfs_category());
+			memcpy(dst, name.c_str(), name.size() + 1);
+		}
+
+		file_type to_file_type(uint64_t mode) noexcept {
+			switch (mode & S_IFMT) {
+			case S_IFREG: return file_type::regular;
+			case S_IFDIR: return file_type::directory;
+			case S_IFLNK: return file_type::symlink;
+			case S_IFBLK: return file_type::block_device;
+			case S_IFCHR: return file_type::char_device;
+			case S_IFIFO: return file_type::fifo;
+			case S_IFSOCK: return file_type::socket;
+			default: return file_type::unknown;
+			}
+		}
+
+		/**
+		 * Turns the object ranges produced by ZFS_IOC_DIFF into records, following the rules of zfs diff.
+		 * A single command buffer and record are reused for every object, so resolving millions of objects
+		 * only costs the ioctls themselves.
+		 */
+		class diff_resolver {
+			libzfs_handle* m_hdl;
+			const std::string& m_from;
+			const std::string& m_to;
+			uint64_t m_shares;
+			const std::function<void(const diff_record&)>& m_cb;
+			std::unique_ptr<zfs_cmd_t> m_zc{new zfs_cmd_t{}};
+			diff_record m_record{};
+
+			struct object_stats {
+				zfs_stat_t stat;
+				std::string path;
+				int error;
+				/** On the delete queue, the stats are valid but there is no path */
+				bool stale;
+			};
+			object_stats m_fstats{};
+			object_stats m_tstats{};
+
+			void get_stats(const std::string& snapshot, uint64_t obj, object_stats& res) {
+				memset(m_zc.get(), 0, sizeof(zfs_cmd_t));
+				copy_name(m_zc->zc_name, sizeof(m_zc->zc_name), snapshot);
+				m_zc->zc_obj = obj;
+				auto err = zfs_ioctl(m_hdl, ZFS_IOC_OBJ_TO_STATS, m_zc.get());
+				res.error = err == 0 ? 0 : errno;
+				// Stats are valid even if the path could not be determined
+				res.stat = m_zc->zc_stat;
+				res.path.clear();
+				if (res.error == 0) res.path = m_zc->zc_value;
+				res.stale = res.error == ESTALE;
+				if (res.stale) res.error = 0;
+			}
+
+			void emit(diff_kind kind, const object_stats& stats, int64_t link_change = 0,
+					  const std::string* new_path = nullptr) {
+				m_record.kind = kind;
+				m_record.type = to_file_type(stats.stat.zs_mode);
+				m_record.path = stats.path;
+				if (new_path)
+					m_record.new_path = *new_path;
+				else
+					m_record.new_path.clear();
+				m_record.link_change = link_change;
+				m_cb(m_record);
+			}
+
+			void inuse(uint64_t obj) {
+				if (obj == m_shares) return;
+				m_record.inode = obj;
+				get_stats(m_from, obj, m_fstats);
+				if (m_fstats.error != 0 && m_fstats.error != ENOTSUP && m_fstats.error != ENOENT)
+					throw std::system_error(m_fstats.error, std::system_category());
+				get_stats(m_to, obj, m_tstats);
+				if (m_tstats.error != 0 && m_tstats.error != ENOTSUP && m_tstats.error != ENOENT)
+					throw std::system_error(m_tstats.error, std::system_category());
+				// Unallocated object sharing a dnode block with a changed one
+				if (m_fstats.error != 0 && m_tstats.error != 0) return;
+
+				auto& fs = m_fstats.stat;
+				auto& ts = m_tstats.stat;
+				int64_t change = 0;
+				if ((fs.zs_mode & S_IFMT) != S_IFDIR && (ts.zs_mode & S_IFMT) != S_IFDIR && fs.zs_links != 0 &&
+					ts.zs_links != 0)
+					change = static_cast<int64_t>(ts.zs_links) - static_cast<int64_t>(fs.zs_links);
+
+				if (m_fstats.error != 0) {
+					emit(diff_kind::added, m_tstats, change);
+				} else if (m_tstats.error != 0) {
+					emit(diff_kind::removed, m_fstats, change);
+				} else if (fs.zs_gen == ts.zs_gen && (fs.zs_mode & S_IFMT) == (ts.zs_mode & S_IFMT)) {
+					if (fs.zs_ctime[0] == ts.zs_ctime[0] && fs.zs_ctime[1] == ts.zs_ctime[1]) return;
+					if (change > 0)
+						emit(diff_kind::added, m_tstats, change);
+					else if (change < 0)
+						emit(diff_kind::removed, m_tstats, change);
+					else if (m_fstats.path == m_tstats.path)
+						emit(diff_kind::modified, m_tstats);
+					else
+						emit(diff_kind::renamed, m_fstats, 0, &m_tstats.path);
+				} else {
+					// The object number was reused for a new file
+					emit(diff_kind::removed, m_fstats);
+					emit(diff_kind::added, m_tstats);
+				}
+			}
+
+			void freed(uint64_t first, uint64_t last) {
+				// Walk the allocated objects of the range in the old snapshot, skipping holes
+				uint64_t obj = first - 1;
+				while (obj < last) {
+					memset(m_zc.get(), 0, sizeof(zfs_cmd_t));
+					copy_name(m_zc->zc_name, sizeof(m_zc->zc_name), m_from);
+					m_zc->zc_obj = obj;
+					if (zfs_ioctl(m_hdl, ZFS_IOC_NEXT_OBJ, m_zc.get()) != 0) {
+						if (errno == ESRCH) return;
+						throw std::system_error(errno, std::system_category());
+					}
+					obj = m_zc->zc_obj;
+					if (obj > last) return;
+					if (obj == m_shares) continue;
+					get_stats(m_from, obj, m_fstats);
+					// Like zfs diff, objects already on the delete queue or gone in the old snapshot are skipped
+					if (m_fstats.stale || m_fstats.error == ENOENT) continue;
+					if (m_fstats.error != 0) throw std::system_error(m_fstats.error, std::system_category());
+					m_record.inode = obj;
+					emit(diff_kind::removed, m_fstats);
+				}
+			}
+
+		public:
+			diff_resolver(libzfs_handle* hdl, const std::string& from, const std::string& to, uint64_t shares,
+						  const std::function<void(const diff_record&)>& cb)
+				: m_hdl(hdl), m_from(from), m_to(to), m_shares(shares), m_cb(cb) {}
+
+			void process(const dmu_diff_record_t& rec) {
+				if (rec.ddr_type == DDR_INUSE) {
+					for (auto obj = rec.ddr_first; obj <= rec.ddr_last && obj != 0; obj++)
+						inuse(obj);
+				} else if (rec.ddr_type == DDR_FREE) {
+					freed(rec.ddr_first, rec.ddr_last);
+				}
+			}
+		};
+	} // namespace
+
+	void dataset::diff(const std::string& from, const std::string& to,
+					   const std::function<void(const diff_record&)>& cb) const {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
+		// Short snapshot names ("@snap") refer to snapshots of this dataset
+		auto fs = name();
+		fs = fs.substr(0, fs.find('@'));
+		auto fromsnap = !from.empty() && from[0] == '@' ? fs + from : from;
+		auto tosnap = !to.empty() && to[0] == '@' ? fs + to : to;
+		if (fromsnap.find('@') == std::string::npos || tosnap.find('@') == std::string::npos)
+			throw std::invalid_argument("diff requires two snapshots");
+
+		// The .zfs/shares directory is reported as changed by the kernel but is not part of the filesystem
+		uint64_t shares = 0;
+		auto mnt = mountpoint();
+		struct stat st {};
+		if (!mnt.empty() && stat((mnt + "/.zfs/shares").c_str(), &st) == 0) shares = st.st_ino;
+
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) != 0) throw std::system_error(errno, std::system_category());
+
+		// zfs_ioctl only issues the ioctl on the handle's fd, so neither side holds the client lock.
+		// The kernel writes the object ranges into the pipe, which is read on this thread while it runs.
+		auto hdl = m_parent->raw();
+		int ioc_error = 0;
+		std::thread differ;
+		try {
+			differ = std::thread([&]() {
+				// A reader that gave up must show up as EPIPE, not as a signal to the process
+				sigset_t set;
+				sigemptyset(&set);
+				sigaddset(&set, SIGPIPE);
+				pthread_sigmask(SIG_BLOCK, &set, nullptr);
+				try {
+					std::unique_ptr<zfs_cmd_t> zc{new zfs_cmd_t{}};
+					copy_name(zc->zc_name, sizeof(zc->zc_name), tosnap);
+					copy_name(zc->zc_value, sizeof(zc->zc_value), fromsnap);
+					zc->zc_cookie = fds[1];
+					if (zfs_ioctl(hdl, ZFS_IOC_DIFF, zc.get()) != 0) ioc_error = errno;
+				} catch (const std::system_error& e) {
+					ioc_error = e.code().value();
+				} catch (const std::bad_alloc&) {
+					ioc_error = ENOMEM;
+				}
+				::close(fds[1]);
+			});
+		} catch (...) {
+			::close(fds[0]);
+			::close(fds[1]);
+			throw;
+		}
+
+		try {
+			diff_resolver resolver{hdl, fromsnap, tosnap, shares, cb};
+			dmu_diff_record_t records[256];
+			size_t filled = 0;
+			while (true) {
+				auto res = read(fds[0], reinterpret_cast<char*>(records) + filled, sizeof(records) - filled);
+				if (res < 0 && errno == EINTR) continue;
+				if (res < 0) throw std::system_error(errno, std::system_category());
+				if (res == 0) break;
+				filled += res;
+				auto n = filled / sizeof(dmu_diff_record_t);
+				for (size_t i = 0; i < n; i++)
+					resolver.process(records[i]);
+				filled -= n * sizeof(dmu_diff_record_t);
+				if (filled != 0) memmove(records, records + n, filled);
+			}
+		} catch (...) {
+			// Closing the read end makes the kernel stop with EPIPE
+			::close(fds[0]);
+			differ.join();
+			throw;
+		}
+		::close(fds[0]);
+		differ.join();
+		if (ioc_error != 0) throw std::system_error(ioc_error, std::system_category());
+	}
+
+} // namespace zfspp
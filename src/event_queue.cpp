@@ -0,0 +1,185 @@
+#include <cstring>
+#include <iterator>
+#include <zfspp.h>
+
+#include <libzfs.h>
+
+namespace zfspp {
+
+	// Every cell carries a sequence number telling whether it is free for the lap of the producer or filled for
+	// the lap of the consumer, so pushing and popping only take a compare and swap on the respective position.
+	event_queue::event_queue(size_t capacity) {
+		// A single cell would carry the same sequence number when filled and when free for the next lap
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		m_cells.reset(new cell[size]);
+		for (size_t i = 0; i < size; i++)
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+		m_mask = size - 1;
+	}
+
+	bool event_queue::try_push(nv_list& value) {
+		auto pos = m_tail.load(std::memory_order_relaxed);
+		cell* c;
+		while (true) {
+			c = &m_cells[pos & m_mask];
+			auto seq = c->seq.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0) {
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+		c->value = std::move(value);
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool event_queue::try_pop(nv_list& value) {
+		auto pos = m_head.load(std::memory_order_relaxed);
+		cell* c;
+		while (true) {
+			c = &m_cells[pos & m_mask];
+			auto seq = c->seq.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0) {
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = m_head.load(std::memory_order_relaxed);
+			}
+		}
+		value = std::move(c->value);
+		c->seq.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	void event_queue::notify_data() {
+		// Pairs with the fence in wait_data, either the consumer sees the event or we see it idle
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_idle_consumers.load() == 0) return;
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_has_data.notify_one();
+	}
+
+	void event_queue::notify_space() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!m_producer_waiting.load()) return;
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_has_space.notify_one();
+	}
+
+	bool event_queue::pop(nv_list& value) {
+		if (!try_pop(value)) return false;
+		notify_space();
+		return true;
+	}
+
+	bool event_queue::wait_data() {
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_idle_consumers++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_has_data.wait(lck, [this]() { return !empty() || m_closed; });
+		m_idle_consumers--;
+		return !empty() || !m_closed;
+	}
+
+	bool event_queue::wait_data_until(std::chrono::steady_clock::time_point deadline) {
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_idle_consumers++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_has_data.wait_until(lck, deadline, [this]() { return !empty() || m_closed; });
+		m_idle_consumers--;
+		return !empty();
+	}
+
+	void event_queue::wait_space(std::chrono::milliseconds timeout, const std::atomic<bool>* stop) {
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_producer_waiting = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_has_space.wait_for(lck, timeout, [&]() { return !full() || (stop != nullptr && *stop); });
+		m_producer_waiting = false;
+	}
+
+	void event_queue::wake_producer() {
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_has_space.notify_all();
+	}
+
+	void event_queue::close() {
+		std::unique_lock<std::mutex> lck{m_park_mtx};
+		m_closed = true;
+		m_has_data.notify_all();
+	}
+
+	bool event_queue::is_coalescible(const nv_list& value) noexcept {
+		char* cls{};
+		if (value.raw() == nullptr || nvlist_lookup_string(value.raw(), "class", &cls) != 0) return false;
+		return strncmp(cls, "ereport.", 8) != 0 && strcmp(cls, "sysevent.fs.zfs.history_event") != 0;
+	}
+
+	size_t event_queue::hold(nv_list& value) {
+		auto raw = value.raw();
+		char* cls{};
+		key_type key{};
+		if (nvlist_lookup_string(raw, "class", &cls) == 0) std::get<0>(key) = cls;
+		nvlist_lookup_uint64(raw, "pool_guid", &std::get<1>(key));
+		nvlist_lookup_uint64(raw, "vdev_guid", &std::get<2>(key));
+		auto it = m_held_index.find(key);
+		if (it != m_held_index.end()) {
+			// The replacement moves to the end, so held events stay ordered by time
+			m_held.erase(it->second);
+			m_held.emplace_back(std::move(key), std::move(value));
+			it->second = std::prev(m_held.end());
+			return 1;
+		}
+		m_held.emplace_back(key, std::move(value));
+		m_held_index.emplace(std::move(key), std::prev(m_held.end()));
+		return 0;
+	}
+
+	void event_queue::flush_held() {
+		while (!m_held.empty() && try_push(m_held.front().second)) {
+			m_held_index.erase(m_held.front().first);
+			m_held.pop_front();
+			notify_data();
+		}
+	}
+
+	size_t event_queue::push(nv_list& value, overflow_policy policy, std::chrono::milliseconds timeout) {
+		size_t dropped = 0;
+		switch (policy) {
+		case overflow_policy::block:
+			// The consumers keep running until the watcher thread exited, so this always finishes
+			while (!try_push(value))
+				wait_space(timeout, nullptr);
+			break;
+		case overflow_policy::drop_oldest:
+			while (!try_push(value)) {
+				nv_list oldest;
+				if (try_pop(oldest)) dropped++;
+			}
+			break;
+		case overflow_policy::coalesce:
+			flush_held();
+			if (m_held.empty() && try_push(value)) break;
+			if (is_coalescible(value)) return hold(value);
+			// Records wait for room behind the events held back before them
+			while (!m_held.empty()) {
+				wait_space(timeout, nullptr);
+				flush_held();
+			}
+			while (!try_push(value))
+				wait_space(timeout, nullptr);
+			break;
+		}
+		notify_data();
+		return dropped;
+	}
+
+} // namespace zfspp
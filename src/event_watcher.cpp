@@ -1,106 +1,548 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
 #include <zfspp.h>
 
-#include <csignal>
+#include <libzfs.h>
+
 #include <mutex>
 
 namespace zfspp {
 
-	event_watcher::event_watcher(zfs& parent)
-        : m_parent(&parent)
-    {}
+	event_filter& event_filter::add_class(std::string_view pattern) {
+		bool prefix = !pattern.empty() && pattern.back() == '*';
+		if (prefix) pattern.remove_suffix(1);
+		if (m_classes.empty()) m_classes.emplace_back();
+		uint32_t cur = 0;
+		for (char c : pattern) {
+			auto& children = m_classes[cur].children;
+			auto it = std::lower_bound(children.begin(), children.end(), c,
+									   [](const std::pair<char, uint32_t>& e, char v) { return e.first < v; });
+			if (it != children.end() && it->first == c) {
+				cur = it->second;
+				continue;
+			}
+			auto next = static_cast<uint32_t>(m_classes.size());
+			children.insert(it, {c, next});
+			m_classes.emplace_back();
+			cur = next;
+		}
+		if (prefix)
+			m_classes[cur].prefix = true;
+		else
+			m_classes[cur].exact = true;
+		return *this;
+	}
+
+	event_filter& event_filter::add_pool(uint64_t guid) {
+		m_pool_guids.insert(guid);
+		return *this;
+	}
+
+	event_filter& event_filter::add_pool(const std::string& name) {
+		m_pool_names.insert(name);
+		return *this;
+	}
+
+	event_filter& event_filter::add_vdev(uint64_t guid) {
+		m_vdev_guids.insert(guid);
+		return *this;
+	}
+
+	bool event_filter::empty() const noexcept {
+		return m_classes.empty() && m_pool_guids.empty() && m_pool_names.empty() && m_vdev_guids.empty();
+	}
+
+	bool event_filter::match_class(const char* cls) const noexcept {
+		uint32_t cur = 0;
+		for (auto p = cls;; p++) {
+			auto& n = m_classes[cur];
+			if (n.prefix) return true;
+			if (*p == '\0') return n.exact;
+			auto it = std::lower_bound(n.children.begin(), n.children.end(), *p,
+									   [](const std::pair<char, uint32_t>& e, char v) { return e.first < v; });
+			if (it == n.children.end() || it->first != *p) return false;
+			cur = it->second;
+		}
+	}
+
+	bool event_filter::matches(::nvlist* event) const noexcept {
+		if (event == nullptr) return false;
+		if (!m_classes.empty()) {
+			char* cls{};
+			if (nvlist_lookup_string(event, "class", &cls) != 0 || !match_class(cls)) return false;
+		}
+		if (!m_pool_guids.empty() || !m_pool_names.empty()) {
+			bool found = false;
+			uint64_t guid{};
+			if (!m_pool_guids.empty() && nvlist_lookup_uint64(event, "pool_guid", &guid) == 0)
+				found = m_pool_guids.count(guid) != 0;
+			// Ereports name the pool in "pool", sysevents in "pool_name"
+			char* name{};
+			if (!found && !m_pool_names.empty() &&
+				(nvlist_lookup_string(event, "pool", &name) == 0 || nvlist_lookup_string(event, "pool_name", &name) == 0))
+				found = m_pool_names.find(std::string_view(name)) != m_pool_names.end();
+			if (!found) return false;
+		}
+		if (!m_vdev_guids.empty()) {
+			uint64_t guid{};
+			if (nvlist_lookup_uint64(event, "vdev_guid", &guid) != 0 || m_vdev_guids.count(guid) == 0) return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Memory mapped checkpoint file with two slots, each in its own sector. Every store goes to the slot
+	 * not holding the latest checkpoint and is synced before the next one, so a torn write can only ever
+	 * damage the older of the two and the checksum tells which one survived.
+	 */
+	struct event_watcher::state_file {
+		static constexpr uint64_t magic = 0x31504b4350504653; // "SFPPCKP1"
+		static constexpr size_t slot_stride = 512;
+
+		struct slot {
+			uint64_t magic;
+			uint64_t generation;
+			uint64_t eid;
+			uint64_t sec;
+			uint64_t nsec;
+			uint8_t boot_id[16];
+			uint64_t checksum;
+		};
+
+		int m_fd{-1};
+		void* m_map{MAP_FAILED};
+		uint64_t m_generation{};
+		std::array<uint8_t, 16> m_boot_id{};
+		std::array<uint64_t, 3> m_stored{};
+		std::chrono::milliseconds m_interval;
+		std::chrono::steady_clock::time_point m_last_sync{std::chrono::steady_clock::now()};
+
+		static uint64_t checksum(const slot& s) noexcept {
+			// FNV-1a over everything before the checksum
+			uint64_t res = 0xcbf29ce484222325;
+			auto data = reinterpret_cast<const uint8_t*>(&s);
+			for (size_t i = 0; i < offsetof(slot, checksum); i++) {
+				res ^= data[i];
+				res *= 0x100000001b3;
+			}
+			return res;
+		}
+
+		static std::array<uint8_t, 16> read_boot_id() {
+			std::array<uint8_t, 16> res{};
+			int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+			if (fd < 0) return res;
+			char buf[64]{};
+			auto len = read(fd, buf, sizeof(buf) - 1);
+			::close(fd);
+			size_t n = 0;
+			for (ssize_t i = 0; i < len && n < 32; i++) {
+				auto c = buf[i];
+				int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+				if (v < 0) continue;
+				res[n / 2] = static_cast<uint8_t>(res[n / 2] << 4 | v);
+				n++;
+			}
+			if (n != 32) res.fill(0);
+			return res;
+		}
+
+		state_file(const std::string& path, std::chrono::milliseconds interval) : m_interval(interval) {
+			m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (m_fd < 0) throw std::system_error(errno, std::system_category(), path);
+			try {
+				struct stat st {};
+				if (fstat(m_fd, &st) != 0) throw std::system_error(errno, std::system_category(), path);
+				if (static_cast<size_t>(st.st_size) < 2 * slot_stride) {
+					if (ftruncate(m_fd, 2 * slot_stride) != 0 || fsync(m_fd) != 0)
+						throw std::system_error(errno, std::system_category(), path);
+				}
+				m_map = mmap(nullptr, 2 * slot_stride, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+				if (m_map == MAP_FAILED) throw std::system_error(errno, std::system_category(), path);
+			} catch (...) {
+				::close(m_fd);
+				throw;
+			}
+			m_boot_id = read_boot_id();
+		}
+		state_file(const state_file&) = delete;
+		state_file& operator=(const state_file&) = delete;
+		~state_file() {
+			munmap(m_map, 2 * slot_stride);
+			::close(m_fd);
+		}
+
+		/** Returns the newest intact slot, or false if there is none */
+		bool load(slot& res) {
+			bool found = false;
+			for (size_t i = 0; i < 2; i++) {
+				slot s;
+				memcpy(&s, static_cast<uint8_t*>(m_map) + i * slot_stride, sizeof(s));
+				if (s.magic != magic || s.checksum != checksum(s)) continue;
+				if (found && s.generation < res.generation) continue;
+				res = s;
+				found = true;
+			}
+			if (found) {
+				m_generation = res.generation;
+				m_stored = {res.eid, res.sec, res.nsec};
+			}
+			return found;
+		}
+
+		bool same_boot(const slot& s) const noexcept {
+			return m_boot_id != std::array<uint8_t, 16>{} && memcmp(s.boot_id, m_boot_id.data(), 16) == 0;
+		}
+
+		void store(const std::array<uint64_t, 3>& chk) {
+			slot s{magic, m_generation + 1, chk[0], chk[1], chk[2], {}, 0};
+			memcpy(s.boot_id, m_boot_id.data(), sizeof(s.boot_id));
+			s.checksum = checksum(s);
+			auto offset = (s.generation % 2) * slot_stride;
+			memcpy(static_cast<uint8_t*>(m_map) + offset, &s, sizeof(s));
+			// The mapping starts page aligned and both slots share its first page
+			if (msync(m_map, 2 * slot_stride, MS_SYNC) != 0) throw std::system_error(errno, std::system_category());
+			m_generation = s.generation;
+			m_stored = chk;
+			m_last_sync = std::chrono::steady_clock::now();
+		}
+	};
+
+	event_watcher::event_watcher(zfs& parent) : m_parent(&parent) {
+		m_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (m_wakefd < 0) throw std::system_error(errno, std::system_category());
+	}
+
 	event_watcher::~event_watcher() {
-        this->stop();
-    }
+		// Only the final sync can fail, which means events are delivered again after the next start
+		try {
+			this->stop();
+		} catch (...) {}
+		::close(m_wakefd);
+	}
 
 	void event_watcher::set_checkpoint(std::array<uint64_t, 3> checkpoint) {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        std::copy(checkpoint.begin(), checkpoint.end(), m_checkpoint.begin());
-    }
+		std::unique_lock<std::mutex> lck{m_mtx};
+		std::copy(checkpoint.begin(), checkpoint.end(), m_checkpoint.begin());
+		m_replaying = true;
+	}
 
 	std::array<uint64_t, 3> event_watcher::checkpoint() const noexcept {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        return m_checkpoint;
-    }
+		std::unique_lock<std::mutex> lck{m_mtx};
+		return m_checkpoint;
+	}
+
+	void event_watcher::set_checkpoint_file(const std::string& path, std::chrono::milliseconds sync_interval) {
+		if (sync_interval.count() < 0) throw std::invalid_argument("sync interval must not be negative");
+		{
+			// With several consumers a newer event can finish while an older one is still processed, so the
+			// checkpoint is no low-watermark and persisting it would skip the older one on resume
+			std::unique_lock<std::mutex> lck{m_mtx};
+			if (m_is_started) throw std::logic_error("event_watcher already started");
+			if (m_consumers > 1) throw std::logic_error("a checkpoint file requires a single consumer thread");
+			m_durable = true;
+		}
+		auto state = std::make_unique<state_file>(path, sync_interval);
+		state_file::slot stored;
+		if (state->load(stored)) {
+			set_checkpoint({stored.eid, stored.sec, stored.nsec});
+			// Event ids restart with every boot, so seeking is only safe within the same one. If the kernel
+			// dropped the event meanwhile, the older ones are skipped while reading instead.
+			if (state->same_boot(stored) && stored.eid != 0) m_parent->seek_event(stored.eid);
+		}
+		std::unique_lock<std::mutex> lck{m_state_mtx};
+		m_state = std::move(state);
+	}
+
+	void event_watcher::sync_checkpoint() { persist_checkpoint(true); }
+
+	void event_watcher::persist_checkpoint(bool force) {
+		// Consumers finishing a batch while another one syncs skip it, the next batch catches up
+		std::unique_lock<std::mutex> lck{m_state_mtx, std::defer_lock};
+		if (force)
+			lck.lock();
+		else if (!lck.try_lock())
+			return;
+		if (!m_state) return;
+		if (!force && std::chrono::steady_clock::now() - m_state->m_last_sync < m_state->m_interval) return;
+		auto chk = checkpoint();
+		if (chk == m_state->m_stored) return;
+		m_state->store(chk);
+	}
 
 	void event_watcher::set_on_event(std::function<void(const nv_list&)> cb) {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        m_on_event = cb;
-    }
+		std::atomic_store(&m_on_event, std::make_shared<const event_callback>(std::move(cb)));
+	}
+
+	void event_watcher::set_on_zevent(std::function<void(const zevent&)> cb) {
+		std::atomic_store(&m_on_zevent, std::make_shared<const zevent_callback>(std::move(cb)));
+	}
+
+	void event_watcher::set_on_events(std::function<void(span<const nv_list>)> cb) {
+		std::atomic_store(&m_on_events, std::make_shared<const batch_callback>(std::move(cb)));
+	}
 
 	void event_watcher::set_on_drop(std::function<void(size_t)> cb) {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        m_on_drop = cb;
-    }
+		std::atomic_store(&m_on_drop, std::make_shared<const drop_callback>(std::move(cb)));
+	}
 
 	void event_watcher::set_on_error(std::function<void()> cb) {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        m_on_error = cb;
-    }
+		std::atomic_store(&m_on_error, std::make_shared<const error_callback>(std::move(cb)));
+	}
+
+	void event_watcher::set_filter(event_filter filter) {
+		std::atomic_store(&m_filter, std::make_shared<const event_filter>(std::move(filter)));
+	}
+
+	void event_watcher::set_poll_interval(std::chrono::milliseconds interval) {
+		if (interval.count() <= 0) throw std::invalid_argument("poll interval must be greater than zero");
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_poll_interval = interval;
+	}
+
+	void event_watcher::set_queue(size_t capacity, overflow_policy policy) {
+		if (capacity == 0) throw std::invalid_argument("queue capacity must be greater than zero");
+		std::unique_lock<std::mutex> lck{m_mtx};
+		if (m_is_started) throw std::logic_error("event_watcher already started");
+		m_queue_capacity = capacity;
+		m_overflow = policy;
+	}
 
+	void event_watcher::set_consumer_threads(size_t count) {
+		if (count == 0) throw std::invalid_argument("at least one consumer thread is required");
+		std::unique_lock<std::mutex> lck{m_mtx};
+		if (m_is_started) throw std::logic_error("event_watcher already started");
+		if (count > 1 && m_durable) throw std::logic_error("a checkpoint file requires a single consumer thread");
+		m_consumers = count;
+	}
+
+	void event_watcher::set_batching(size_t max_size, std::chrono::milliseconds max_latency) {
+		if (max_size == 0) throw std::invalid_argument("batch size must be greater than zero");
+		if (max_latency.count() < 0) throw std::invalid_argument("batch latency must not be negative");
+		std::unique_lock<std::mutex> lck{m_mtx};
+		if (m_is_started) throw std::logic_error("event_watcher already started");
+		m_max_batch = max_size;
+		m_max_latency = max_latency;
+	}
 
 	void event_watcher::start() {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        m_should_stop = false;
-        m_watcher_thread = std::thread([this](){
-		    signal(SIGUSR1, [](int) {});
-            try {
-                this->thread_fn();
-            } catch(...) {
-                std::unique_lock<std::mutex> lck{m_mtx};
-                if(m_on_error) m_on_error();
-            }
-            m_is_started = false;
-        });
-        m_is_started = true;
-    }
+		std::unique_lock<std::mutex> lifecycle{m_lifecycle_mtx};
+		std::unique_lock<std::mutex> lck{m_mtx};
+		if (m_is_started) throw std::logic_error("event_watcher already started");
+		m_should_stop = false;
+		m_queue = std::make_unique<event_queue>(m_queue_capacity);
+		m_is_started = true;
+		auto consumers = m_consumers;
+		lck.unlock();
+		try {
+			for (size_t i = 0; i < consumers; i++)
+				m_consumer_threads.emplace_back([this]() { this->consumer_fn(); });
+			m_watcher_thread = std::thread([this]() {
+				try {
+					this->thread_fn();
+				} catch (...) { this->report_error(); }
+			});
+		} catch (...) {
+			this->shutdown();
+			throw;
+		}
+	}
 
 	void event_watcher::stop() {
-        std::unique_lock<std::mutex> lck{m_mtx};
-        m_should_stop = true;
-        if(m_watcher_thread.joinable()) {
-            pthread_kill(m_watcher_thread.native_handle(), SIGUSR1);
-            m_watcher_thread.join();
-        }
-        if(m_is_started != false) throw std::logic_error("ASSERT_FAILED");
-    }
-
-    namespace {
-        std::array<uint64_t, 3> parse_checkpoint(const nv_list& info) {
-            auto time = info.find("time");
-            auto eid = info.find("eid");
-            if(time == info.end() || eid == info.end()) return {};
-            if(time.type() != nv_type::int64_array || eid.type() != nv_type::uint64) return {};
-            auto time_val = time.as_int64_array();
-            auto eid_val = eid.as_uint64();
-            if(time_val.size() != 2) return {};
-            return {eid_val, static_cast<uint64_t>(time_val[0]), static_cast<uint64_t>(time_val[1])};
-        }
-    }
-
-    void event_watcher::thread_fn() {
-		zfspp::nv_list info{};
+		std::unique_lock<std::mutex> lifecycle{m_lifecycle_mtx};
+		if (m_is_started) this->shutdown();
+		persist_checkpoint(true);
+	}
+
+	void event_watcher::shutdown() noexcept {
+		m_should_stop = true;
+		uint64_t one = 1;
+		// A lost wakeup only delays the exit of the watcher thread until the poll interval passed
+		if (write(m_wakefd, &one, sizeof(one)) < 0) {}
+		m_queue->wake_producer();
+		if (m_watcher_thread.joinable()) m_watcher_thread.join();
+		m_queue->close();
+		for (auto& e : m_consumer_threads)
+			e.join();
+		m_consumer_threads.clear();
+		m_queue.reset();
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_should_stop = false;
+		m_is_started = false;
+	}
+
+	size_t event_watcher::poll() {
+		if (m_is_started) throw std::logic_error("event_watcher is running on its own thread");
+		size_t max_batch;
+		{
+			std::unique_lock<std::mutex> lck{m_mtx};
+			max_batch = m_max_batch;
+		}
+		std::vector<nv_list> batch(max_batch);
+		size_t count = 0;
+		while (true) {
+			size_t n = 0;
+			while (n < max_batch && read_event(batch[n]))
+				n++;
+			if (n == 0) break;
+			deliver({batch.data(), n});
+			count += n;
+		}
+		return count;
+	}
+
+	namespace {
+		std::array<uint64_t, 3> parse_checkpoint(const nv_list& info) {
+			uint64_t eid{};
+			int64_t* time{};
+			uint_t count{};
+			if (info.raw() == nullptr || nvlist_lookup_uint64(info.raw(), "eid", &eid) != 0 ||
+				nvlist_lookup_int64_array(info.raw(), "time", &time, &count) != 0 || count != 2)
+				return {};
+			return {eid, static_cast<uint64_t>(time[0]), static_cast<uint64_t>(time[1])};
+		}
+
+		bool is_newer(const std::array<uint64_t, 3>& a, const std::array<uint64_t, 3>& b) {
+			return a[1] > b[1] || (a[1] == b[1] && a[2] > b[2]);
+		}
+	} // namespace
+
+	bool event_watcher::read_event(nv_list& info) {
 		size_t n_dropped{};
-        while(m_parent->next_event(info, &n_dropped, false)) {
-            auto chk = parse_checkpoint(info);
-            if(chk[0] == 0 && chk[1] == 0 && chk[2] == 0) continue;
-            if(chk[1] < m_checkpoint[1] || (chk[1] == m_checkpoint[1] && chk[2] <= m_checkpoint[2])) continue;
-            std::unique_lock<std::mutex> lck{m_mtx};
-            m_checkpoint = chk;
-            if(!info.empty() && m_on_event) m_on_event(info);
-            break;
-        }
+		auto filter = std::atomic_load(&m_filter);
+		while (!m_should_stop && m_parent->next_event(info, &n_dropped, false)) {
+			if (n_dropped != 0) report_drop(n_dropped);
+			if (info.empty()) continue;
+			if (filter && !filter->matches(info.raw())) continue;
+			std::unique_lock<std::mutex> lck{m_mtx};
+			if (m_replaying) {
+				// Skip what the previous run already delivered, the queue is ordered by time
+				auto chk = parse_checkpoint(info);
+				if (chk[0] == 0 && chk[1] == 0 && chk[2] == 0) continue;
+				if (!is_newer(chk, m_checkpoint)) continue;
+				m_replaying = false;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void event_watcher::deliver(span<const nv_list> batch) {
+		auto batch_cb = std::atomic_load(&m_on_events);
+		if (batch_cb && *batch_cb) {
+			(*batch_cb)(batch);
+		} else {
+			auto zevent_cb = std::atomic_load(&m_on_zevent);
+			auto cb = std::atomic_load(&m_on_event);
+			for (auto& e : batch) {
+				if (zevent_cb && *zevent_cb) (*zevent_cb)(zevent{e});
+				if (cb && *cb) (*cb)(e);
+			}
+		}
+		// Events of a batch are in queue order, so the last one carrying a timestamp is the newest
+		std::array<uint64_t, 3> chk{};
+		for (auto it = batch.end(); it != batch.begin() && chk[0] == 0 && chk[1] == 0 && chk[2] == 0;)
+			chk = parse_checkpoint(*--it);
+		if (chk[0] == 0 && chk[1] == 0 && chk[2] == 0) return;
+		{
+			std::unique_lock<std::mutex> lck{m_mtx};
+			if (!is_newer(m_checkpoint, chk)) m_checkpoint = chk;
+		}
+		persist_checkpoint(false);
+	}
+
+	void event_watcher::report_drop(size_t count) {
+		auto cb = std::atomic_load(&m_on_drop);
+		if (cb && *cb) (*cb)(count);
+	}
+
+	void event_watcher::report_error() {
+		auto cb = std::atomic_load(&m_on_error);
+		if (cb && *cb) (*cb)();
+	}
+
+	void event_watcher::consumer_fn() {
+		auto& q = *m_queue;
+		size_t max_batch;
+		std::chrono::milliseconds max_latency;
+		{
+			std::unique_lock<std::mutex> lck{m_mtx};
+			max_batch = m_max_batch;
+			max_latency = m_max_latency;
+		}
+		std::vector<nv_list> batch(max_batch);
+		while (true) {
+			if (!q.pop(batch[0])) {
+				if (!q.wait_data()) break;
+				continue;
+			}
+			size_t n = 1;
+			auto deadline = std::chrono::steady_clock::now() + max_latency;
+			while (n < max_batch) {
+				if (q.pop(batch[n])) {
+					n++;
+					continue;
+				}
+				if (max_latency.count() == 0 || !q.wait_data_until(deadline)) break;
+			}
+			// A throwing callback only loses its own batch, the remaining ones are still delivered
+			try {
+				deliver({batch.data(), n});
+			} catch (...) { report_error(); }
+			for (size_t i = 0; i < n; i++)
+				batch[i] = nv_list{};
+		}
+	}
+
+	void event_watcher::thread_fn() {
+		auto& q = *m_queue;
+		pollfd pfd{m_wakefd, POLLIN, 0};
+		nv_list info;
+		std::chrono::milliseconds interval{};
 		while (!m_should_stop) {
-			if (!m_parent->next_event(info, &n_dropped, true) && m_should_stop) break;
-            std::unique_lock<std::mutex> lck{m_mtx};
-            auto chk = parse_checkpoint(info);
-            if(!info.empty() && m_on_event) m_on_event(info);
-            if(n_dropped != 0 && m_on_drop) m_on_drop(n_dropped);
-            if(chk[0] != 0 || chk[1] != 0 || chk[2] != 0)
-                m_checkpoint = chk;
-            if(m_should_stop) break;
-		}
-    }
-
-} // namespace zfspp
\ No newline at end of file
+			{
+				std::unique_lock<std::mutex> lck{m_mtx};
+				interval = m_poll_interval;
+			}
+			size_t count = 0;
+			size_t dropped = 0;
+			if (m_overflow == overflow_policy::coalesce) q.flush_held();
+			while (read_event(info)) {
+				dropped += q.push(info, m_overflow, interval);
+				count++;
+			}
+			if (dropped != 0) report_drop(dropped);
+			if (count != 0) continue;
+			if (q.held() != 0) {
+				// Coalesced events are waiting for room, which the consumers signal directly
+				q.wait_space(interval, &m_should_stop);
+				continue;
+			}
+			auto res = ::poll(&pfd, 1, static_cast<int>(interval.count()));
+			if (res < 0 && errno != EINTR) throw std::system_error(errno, std::system_category());
+			if (res > 0) {
+				uint64_t value;
+				if (read(m_wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+					throw std::system_error(errno, std::system_category());
+			}
+		}
+		// Events held back are handed over before exiting, the consumers still run until then
+		while (q.held() != 0) {
+			q.flush_held();
+			if (q.held() != 0) q.wait_space(interval, nullptr);
+		}
+	}
+
+} // namespace zfspp
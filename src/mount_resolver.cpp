@@ -0,0 +1,247 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include <libzfs.h>
+
+namespace zfspp {
+
+	namespace {
+		// mountinfo escapes whitespace and backslashes as three digit octal sequences (e.g. "\040")
+		std::string unescape_mountinfo(std::string_view in) {
+			std::string res;
+			res.reserve(in.size());
+			for (size_t i = 0; i < in.size(); i++) {
+				if (in[i] == '\\' && i + 3 < in.size() && in[i + 1] >= '0' && in[i + 1] <= '7' &&
+					in[i + 2] >= '0' && in[i + 2] <= '7' && in[i + 3] >= '0' && in[i + 3] <= '7') {
+					res += static_cast<char>(((in[i + 1] - '0') << 6) | ((in[i + 2] - '0') << 3) | (in[i + 3] - '0'));
+					i += 3;
+				} else
+					res += in[i];
+			}
+			return res;
+		}
+
+		template<typename TFunc>
+		void for_each_component(std::string_view path, TFunc&& fn) {
+			size_t pos = 0;
+			while (pos < path.size()) {
+				auto end = path.find('/', pos);
+				if (end == std::string_view::npos) end = path.size();
+				if (end != pos) {
+					if (!fn(path.substr(pos, end - pos), end)) return;
+				}
+				pos = end + 1;
+			}
+		}
+
+		/**
+		 * Parse a single mountinfo line into mountpoint and dataset.
+		 * Non-zfs mounts yield an empty dataset name.
+		 */
+		bool parse_mountinfo_line(std::string_view line, std::string& mountpoint, std::string& dataset) {
+			std::string_view fields[5];
+			size_t nfields = 0;
+			size_t pos = 0;
+			auto next_field = [&]() -> std::string_view {
+				while (pos < line.size() && line[pos] == ' ')
+					pos++;
+				auto end = line.find(' ', pos);
+				if (end == std::string_view::npos) end = line.size();
+				auto res = line.substr(pos, end - pos);
+				pos = end;
+				return res;
+			};
+			for (; nfields < 5; nfields++) {
+				fields[nfields] = next_field();
+				if (fields[nfields].empty()) return false;
+			}
+			// Skip optional fields up to the separator
+			std::string_view field;
+			do {
+				field = next_field();
+				if (field.empty()) return false;
+			} while (field != "-");
+			auto fstype = next_field();
+			auto source = next_field();
+			mountpoint = unescape_mountinfo(fields[4]);
+			// Bind mounts of a dataset subdirectory still belong to that dataset
+			if (fstype == "zfs")
+				dataset = unescape_mountinfo(source);
+			else
+				dataset.clear();
+			return true;
+		}
+	} // namespace
+
+	mount_resolver::mount_resolver() {
+		m_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (m_fd < 0) throw std::system_error(errno, std::system_category());
+		try {
+			refresh();
+		} catch (...) {
+			::close(m_fd);
+			throw;
+		}
+	}
+
+	mount_resolver::mount_resolver(std::string_view mountinfo) { update(mountinfo); }
+
+	mount_resolver::~mount_resolver() {
+		if (m_fd >= 0) ::close(m_fd);
+	}
+
+	void mount_resolver::insert(const std::string& mountpoint, const std::string& dataset) {
+		node* n = &m_root;
+		for_each_component(mountpoint, [&](std::string_view comp, size_t) {
+			auto it = n->children.find(comp);
+			if (it == n->children.end())
+				it = n->children.emplace(std::string{comp}, std::unique_ptr<node>(new node())).first;
+			n = it->second.get();
+			return true;
+		});
+		n->dataset = dataset;
+		n->mounted = true;
+	}
+
+	void mount_resolver::erase(const std::string& mountpoint) {
+		std::vector<std::pair<node*, std::string_view>> trail;
+		node* n = &m_root;
+		bool found = true;
+		for_each_component(mountpoint, [&](std::string_view comp, size_t) {
+			auto it = n->children.find(comp);
+			if (it == n->children.end()) {
+				found = false;
+				return false;
+			}
+			trail.emplace_back(n, it->first);
+			n = it->second.get();
+			return true;
+		});
+		if (!found) return;
+		n->mounted = false;
+		n->dataset.clear();
+		// Prune nodes that neither carry a mount nor lead to one
+		while (!trail.empty() && !n->mounted && n->children.empty()) {
+			auto parent = trail.back().first;
+			parent->children.erase(parent->children.find(trail.back().second));
+			trail.pop_back();
+			n = parent;
+		}
+	}
+
+	void mount_resolver::refresh() {
+		if (m_fd < 0) throw std::logic_error("mount_resolver was not created from /proc/self/mountinfo");
+		std::unique_lock<std::mutex> lck{m_mtx};
+		// mountinfo has to be read from the start to rearm the change notification
+		if (lseek(m_fd, 0, SEEK_SET) < 0) throw std::system_error(errno, std::system_category());
+		m_buffer.clear();
+		char buf[16384];
+		while (true) {
+			auto res = read(m_fd, buf, sizeof(buf));
+			if (res < 0 && errno == EINTR) continue;
+			if (res < 0) throw std::system_error(errno, std::system_category());
+			if (res == 0) break;
+			m_buffer.append(buf, res);
+		}
+		apply_buffer();
+	}
+
+	void mount_resolver::update(std::string_view mountinfo) {
+		std::unique_lock<std::mutex> lck{m_mtx};
+		m_buffer.assign(mountinfo);
+		apply_buffer();
+	}
+
+	void mount_resolver::apply_buffer() {
+		// The kernel can only report that something changed, so the whole table is read every time.
+		// Parsing and the trie are skipped if the content is the same, e.g. after a mount and its unmount.
+		if (m_buffer == m_previous) return;
+
+		// Later lines win, so stacked mounts resolve to the topmost one
+		std::map<std::string, std::string> mounts;
+		std::string mountpoint, dataset;
+		std::string_view data{m_buffer};
+		while (!data.empty()) {
+			auto end = data.find('\n');
+			if (end == std::string_view::npos) end = data.size();
+			if (parse_mountinfo_line(data.substr(0, end), mountpoint, dataset)) mounts[mountpoint] = dataset;
+			data.remove_prefix(std::min(end + 1, data.size()));
+		}
+
+		// Apply only the difference to the trie
+		auto old_it = m_mounts.begin();
+		auto new_it = mounts.begin();
+		while (old_it != m_mounts.end() || new_it != mounts.end()) {
+			if (new_it == mounts.end() || (old_it != m_mounts.end() && old_it->first < new_it->first)) {
+				erase(old_it->first);
+				++old_it;
+			} else if (old_it == m_mounts.end() || new_it->first < old_it->first) {
+				insert(new_it->first, new_it->second);
+				++new_it;
+			} else {
+				if (old_it->second != new_it->second) insert(new_it->first, new_it->second);
+				++old_it;
+				++new_it;
+			}
+		}
+		m_mounts = std::move(mounts);
+		m_previous.swap(m_buffer);
+	}
+
+	bool mount_resolver::refresh_if_changed() {
+		if (m_fd < 0) return false;
+		pollfd pfd{};
+		pfd.fd = m_fd;
+		pfd.events = POLLPRI;
+		auto res = poll(&pfd, 1, 0);
+		if (res < 0 && errno != EINTR) throw std::system_error(errno, std::system_category());
+		if (res <= 0 || (pfd.revents & (POLLPRI | POLLERR)) == 0) return false;
+		refresh();
+		return true;
+	}
+
+	bool mount_resolver::resolve(const std::string& path, std::string& dataset, std::string* mountpoint) const {
+		if (path.empty() || path[0] != '/') return false;
+		std::unique_lock<std::mutex> lck{m_mtx};
+		const node* n = &m_root;
+		const node* best = m_root.mounted ? &m_root : nullptr;
+		size_t best_end = 0;
+		for_each_component(path, [&](std::string_view comp, size_t end) {
+			auto it = n->children.find(comp);
+			if (it == n->children.end()) return false;
+			n = it->second.get();
+			if (n->mounted) {
+				best = n;
+				best_end = end;
+			}
+			return true;
+		});
+		// Foreign filesystems mounted on top of a dataset hide it
+		if (best == nullptr || best->dataset.empty()) return false;
+		dataset = best->dataset;
+		if (mountpoint) *mountpoint = best_end == 0 ? "/" : path.substr(0, best_end);
+		return true;
+	}
+
+	size_t mount_resolver::size() const noexcept {
+		std::unique_lock<std::mutex> lck{m_mtx};
+		return m_mounts.size();
+	}
+
+	dataset zfs::open_dataset_from_fs_path(const std::string& path, const mount_resolver& resolver, dataset_type dt) {
+		std::string name;
+		if (!resolver.resolve(path, name)) throw std::system_error(EZFS_NOENT, zfs_category());
+		return open_dataset(name, dt);
+	}
+
+} // namespace zfspp
@@ -1,6 +1,8 @@
 #include "zfspp.h"
 
+#include <cerrno>
 #include <libzfs.h>
+#include <libzutil.h>
 #include <mutex>
 #include <stdexcept>
 #include <sys/fs/zfs.h>
@@ -11,13 +13,19 @@ namespace zfspp {
 
 	pool zfs::create_pool(const std::string& name, const nv_list& topology, const nv_list& pool_options,
 						  const nv_list& fs_options, bool enable_all_features) {
+		// The feature table is fixed at compile time, so the property names only need to be built once
+		static const std::vector<std::string> feature_props = []() {
+			std::vector<std::string> res;
+			res.reserve(SPA_FEATURES);
+			for (auto& e : spa_feature_table)
+				res.push_back(std::string("feature@") + e.fi_uname);
+			return res;
+		}();
+
 		auto pool_opts = pool_options;
 		if (enable_all_features) {
-			for (auto& e : spa_feature_table) {
-				std::string fname = "feature@";
-				fname += e.fi_uname;
-				pool_opts.add_string(fname.c_str(), "enabled");
-			}
+			for (auto& e : feature_props)
+				pool_opts.add_string(e.c_str(), "enabled");
 		}
 
 		std::unique_lock<std::recursive_mutex> lck{m_mutex};
@@ -28,6 +36,11 @@ namespace zfspp {
 		return pool(*this, hdl);
 	}
 
+	pool zfs::create_pool(const std::string& name, const vdev_topology& topology, const nv_list& pool_options,
+						  const nv_list& fs_options, bool enable_all_features) {
+		return create_pool(name, topology.build(), pool_options, fs_options, enable_all_features);
+	}
+
 	pool zfs::open_pool(const std::string& name) {
 		std::unique_lock<std::recursive_mutex> lck{m_mutex};
 		auto hdl = zpool_open(m_handle, name.c_str());
@@ -63,6 +76,102 @@ namespace zfspp {
 		return std::move(state.result);
 	}
 
+	void zfs::pool_summaries(std::vector<pool_summary>& out) {
+		struct _state {
+			std::vector<pool_summary>& out;
+			size_t count;
+			bool alloc_failed;
+		} state{out, 0, false};
+		std::unique_lock<std::recursive_mutex> lck{m_mutex};
+		zpool_iter(
+			m_handle,
+			[](zpool_handle_t* hdl, void* udata) -> int {
+				auto ptr = static_cast<_state*>(udata);
+				if (!ptr->alloc_failed) {
+					try {
+						if (ptr->count == ptr->out.size()) ptr->out.emplace_back();
+						auto& e = ptr->out[ptr->count];
+						// Assigning keeps the capacity of the previous name
+						e.name.assign(zpool_get_name(hdl));
+						e.guid = zpool_get_prop_int(hdl, ZPOOL_PROP_GUID, nullptr);
+						e.state = zpool_get_state(hdl);
+						char* msg{};
+						e.status = static_cast<pool_status>(zpool_get_status(hdl, &msg, nullptr));
+						e.size = zpool_get_prop_int(hdl, ZPOOL_PROP_SIZE, nullptr);
+						e.alloc = zpool_get_prop_int(hdl, ZPOOL_PROP_ALLOCATED, nullptr);
+						e.free = zpool_get_prop_int(hdl, ZPOOL_PROP_FREE, nullptr);
+						e.fragmentation = zpool_get_prop_int(hdl, ZPOOL_PROP_FRAGMENTATION, nullptr);
+						e.capacity = zpool_get_prop_int(hdl, ZPOOL_PROP_CAPACITY, nullptr);
+						e.health = zpool_get_state_str(hdl);
+						ptr->count++;
+					} catch (...) { ptr->alloc_failed = true; }
+				}
+				zpool_close(hdl);
+				return 0;
+			},
+			&state);
+		if (state.alloc_failed) throw std::bad_alloc();
+		out.resize(state.count);
+	}
+
+	std::vector<importable_pool> zfs::discover_importable(const std::vector<std::string>& search_dirs,
+														  bool use_cachefile) {
+		std::vector<char*> paths;
+		for (auto& e : search_dirs)
+			paths.push_back(const_cast<char*>(e.c_str()));
+		importargs_t args{};
+		args.path = paths.empty() ? nullptr : paths.data();
+		args.paths = static_cast<int>(paths.size());
+		// The cachefile lists the configs directly, they are only verified by a tryimport each
+		if (use_cachefile) args.cachefile = ZPOOL_CACHE;
+
+		// libzutil reads the labels of all candidate devices on a thread pool, the handle is only used
+		// afterwards to verify the assembled configs with the kernel
+		nvlist_t* found{};
+		{
+			std::unique_lock<std::recursive_mutex> lck{m_mutex};
+			// libzutil reports failures through errno only, the handle keeps whatever an earlier call left
+			errno = 0;
+			found = zpool_search_import(m_handle, &args, &libzfs_config_ops);
+			if (found == nullptr) {
+				auto err = errno;
+				// No pool was ever imported with the cachefile
+				if (use_cachefile && err == ENOENT) return {};
+				throw std::system_error(err != 0 ? err : EIO, std::system_category());
+			}
+		}
+		nv_list pools{found, nv_list::adopt_list{}};
+
+		std::vector<importable_pool> res;
+		for (auto& e : pools) {
+			if (e.type() != nv_type::nvlist) continue;
+			auto config = e.as_nvlist();
+			nvlist_t* raw = config.raw();
+			importable_pool info{e.key(), 0, 0, {}};
+			nvlist_lookup_uint64(raw, ZPOOL_CONFIG_POOL_GUID, &info.guid);
+			nvlist_lookup_uint64(raw, ZPOOL_CONFIG_POOL_STATE, &info.state);
+			info.config = std::move(config);
+			res.push_back(std::move(info));
+		}
+		return res;
+	}
+
+	static_assert(static_cast<int>(import_flags::checkpoint) == ZFS_IMPORT_CHECKPOINT, "import_flags mismatch");
+
+	pool zfs::import_pool(const nv_list& config, const nv_list& props, import_flags flags) {
+		char* name{};
+		if (config.raw() == nullptr || nvlist_lookup_string(config.raw(), ZPOOL_CONFIG_POOL_NAME, &name) != 0)
+			throw std::invalid_argument("config does not name a pool");
+
+		std::unique_lock<std::recursive_mutex> lck{m_mutex};
+		if (zpool_import_props(m_handle, config.raw(), nullptr, props.empty() ? nullptr : props.raw(),
+							   static_cast<int>(flags)) != 0)
+			throw std::system_error(libzfs_errno(m_handle), zfs_category());
+		auto hdl = zpool_open(m_handle, name);
+		if (hdl == nullptr) throw std::system_error(libzfs_errno(m_handle), zfs_category());
+		return pool(*this, hdl);
+	}
+
 	pool& pool::operator=(pool&& other) {
 		m_parent = other.m_parent;
 		if (m_pool) zpool_close(m_pool);
@@ -113,6 +222,37 @@ namespace zfspp {
 		return zpool_get_features(m_pool);
 	}
 
+	uint64_t pool::read_history(uint64_t offset, const std::function<void(const nv_list&)>& cb) {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		boolean_t eof = B_FALSE;
+		while (!eof) {
+			// Every call reads about 1MB of records, starting at offset and advancing it past them
+			nvlist_t* chunk{};
+			auto next = offset;
+			{
+				std::unique_lock<zfs> lck{*m_parent};
+				auto err = zpool_get_history(m_pool, &chunk, &next, &eof);
+				if (err == ENOMEM) throw std::bad_alloc();
+				if (err != 0) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+			}
+			nv_list history{chunk, nv_list::adopt_list{}};
+			nvlist_t** records{};
+			uint_t count{};
+			if (nvlist_lookup_nvlist_array(chunk, ZPOOL_HIST_RECORD, &records, &count) == 0) {
+				for (uint_t i = 0; i < count; i++) {
+					// Borrow the record instead of copying it, it is freed along with history
+					struct borrowed_list : nv_list {
+						explicit borrowed_list(nvlist_t* list) : nv_list(list, adopt_list{}) {}
+						~borrowed_list() { release(); }
+					} record{records[i]};
+					cb(record);
+				}
+			}
+			offset = next;
+		}
+		return offset;
+	}
+
 	void pool::destroy(bool force) {
 		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
 		std::unique_lock<zfs> lck{*m_parent};
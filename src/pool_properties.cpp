@@ -0,0 +1,103 @@
+#include "zfspp.h"
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		static_assert(static_cast<int>(pool_property::name) == ZPOOL_PROP_NAME, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::size) == ZPOOL_PROP_SIZE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::capacity) == ZPOOL_PROP_CAPACITY, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::altroot) == ZPOOL_PROP_ALTROOT, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::health) == ZPOOL_PROP_HEALTH, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::guid) == ZPOOL_PROP_GUID, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::version) == ZPOOL_PROP_VERSION, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::bootfs) == ZPOOL_PROP_BOOTFS, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::delegation) == ZPOOL_PROP_DELEGATION, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::autoreplace) == ZPOOL_PROP_AUTOREPLACE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::cachefile) == ZPOOL_PROP_CACHEFILE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::failuremode) == ZPOOL_PROP_FAILUREMODE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::listsnapshots) == ZPOOL_PROP_LISTSNAPS, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::autoexpand) == ZPOOL_PROP_AUTOEXPAND, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::dedupditto) == ZPOOL_PROP_DEDUPDITTO, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::dedupratio) == ZPOOL_PROP_DEDUPRATIO, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::free) == ZPOOL_PROP_FREE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::allocated) == ZPOOL_PROP_ALLOCATED, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::readonly) == ZPOOL_PROP_READONLY, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::ashift) == ZPOOL_PROP_ASHIFT, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::comment) == ZPOOL_PROP_COMMENT, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::expandsize) == ZPOOL_PROP_EXPANDSZ, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::freeing) == ZPOOL_PROP_FREEING, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::fragmentation) == ZPOOL_PROP_FRAGMENTATION, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::leaked) == ZPOOL_PROP_LEAKED, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::maxblocksize) == ZPOOL_PROP_MAXBLOCKSIZE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::tname) == ZPOOL_PROP_TNAME, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::maxdnodesize) == ZPOOL_PROP_MAXDNODESIZE, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::multihost) == ZPOOL_PROP_MULTIHOST, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::checkpoint) == ZPOOL_PROP_CHECKPOINT, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::load_guid) == ZPOOL_PROP_LOAD_GUID, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::autotrim) == ZPOOL_PROP_AUTOTRIM, "pool_property mismatch");
+		static_assert(static_cast<int>(pool_property::compatibility) == ZPOOL_PROP_COMPATIBILITY, "pool_property mismatch");
+		// Newer OpenZFS releases append properties, those are simply not exposed yet
+		static_assert(pool_property_count <= ZPOOL_NUM_PROPS, "pool_property mismatch");
+
+		std::string get_prop(zpool_handle_t* hdl, pool_property prop, bool literal, std::string& buf) {
+			if (zpool_get_prop(hdl, static_cast<zpool_prop_t>(prop), &buf[0], buf.size(), nullptr,
+							   literal ? B_TRUE : B_FALSE) != 0)
+				throw std::system_error(EZFS_BADPROP, zfs_category());
+			return buf.c_str();
+		}
+	} // namespace
+
+	uint64_t pool::get_uint64(pool_property prop) const noexcept {
+		if (m_pool == nullptr || m_parent == nullptr) return 0;
+		std::unique_lock<zfs> lck{*m_parent};
+		return zpool_get_prop_int(m_pool, static_cast<zpool_prop_t>(prop), nullptr);
+	}
+
+	std::string pool::get_string(pool_property prop, bool literal) const {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::string buf(ZFS_MAXPROPLEN, '\0');
+		std::unique_lock<zfs> lck{*m_parent};
+		return get_prop(m_pool, prop, literal, buf);
+	}
+
+	std::vector<std::string> pool::get_properties(const std::vector<pool_property>& props, bool literal) const {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::vector<std::string> res;
+		res.reserve(props.size());
+		std::string buf(ZFS_MAXPROPLEN, '\0');
+		std::unique_lock<zfs> lck{*m_parent};
+		for (auto e : props)
+			res.push_back(get_prop(m_pool, e, literal, buf));
+		return res;
+	}
+
+	void pool::set_properties(const nv_list& props) {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		for (auto& e : props) {
+			if (e.type() != nv_type::string) throw std::invalid_argument("property values must be strings: " + e.key());
+		}
+		// libzfs only validates and converts values (e.g. failmode names to indices) one property at a time
+		std::unique_lock<zfs> lck{*m_parent};
+		for (auto& e : props) {
+			if (zpool_set_prop(m_pool, e.key().c_str(), e.as_string().c_str()) != 0)
+				throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		}
+	}
+
+	void pool::refresh_properties() {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		auto hdl = zpool_open_canfail(m_parent->raw(), zpool_get_name(m_pool));
+		if (hdl == nullptr) throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		zpool_close(m_pool);
+		m_pool = hdl;
+	}
+
+} // namespace zfspp
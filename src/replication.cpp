@@ -0,0 +1,444 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		std::string pool_of(const std::string& name) { return name.substr(0, name.find_first_of("/@#")); }
+
+		bool is_broken_pipe(const std::exception_ptr& e) {
+			try {
+				std::rethrow_exception(e);
+			} catch (const std::system_error& ex) {
+				return ex.code() == std::errc::broken_pipe;
+			} catch (...) {
+				return false;
+			}
+		}
+
+		/**
+		 * Returns the snapshot the token resumes if it belongs to the stream of task, empty if it is left over
+		 * from another one, e.g. an older snapshot, another incremental source or an earlier job.
+		 */
+		std::string resumed_snapshot(zfs& client, const replication_task& task, bool intermediates,
+									 const std::string& token) {
+			::nvlist* raw;
+			{
+				std::unique_lock<zfs> lck{client};
+				raw = zfs_send_resume_token_to_nvlist(client.raw(), token.c_str());
+			}
+			if (raw == nullptr) return "";
+			nv_list info{raw, nv_list::adopt_list{}};
+			char* toname{};
+			if (nvlist_lookup_string(raw, "toname", &toname) != 0) return "";
+			std::string_view name{toname};
+			auto fsname = task.source.substr(0, task.source.find('@'));
+			auto pos = name.find('@');
+			if (pos == std::string_view::npos || name.substr(0, pos) != fsname) return "";
+			// A substream of -I, the snapshots after it are sent incrementally from it afterwards
+			if (intermediates) return std::string{name};
+			if (name != task.source) return "";
+
+			uint64_t fromguid{};
+			nvlist_lookup_uint64(raw, "fromguid", &fromguid);
+			if (task.from.empty()) return fromguid == 0 ? std::string{name} : "";
+			auto from = task.from[0] == '@' || task.from[0] == '#' ? fsname + task.from : task.from;
+			uint64_t guid{};
+			try {
+				auto ds = client.open_dataset(from, dataset_type::snapshot | dataset_type::bookmark);
+				std::unique_lock<zfs> lck{client};
+				guid = zfs_prop_get_int(ds.raw(), ZFS_PROP_GUID);
+			} catch (const std::system_error&) {
+				return "";
+			}
+			return fromguid == guid ? std::string{name} : "";
+		}
+
+		void write_all(int fd, const std::string& data) {
+			size_t pos = 0;
+			while (pos < data.size()) {
+				auto res = write(fd, data.data() + pos, data.size() - pos);
+				if (res < 0 && errno == EINTR) continue;
+				if (res < 0) throw std::system_error(errno, std::system_category());
+				pos += res;
+			}
+		}
+	} // namespace
+
+	replication_job::replication_job(replication_options options) : m_options(std::move(options)) {
+		if (m_options.max_concurrency == 0) throw std::invalid_argument("max_concurrency must be greater than zero");
+		// Without this an interrupted local receive leaves nothing to resume from
+		m_options.receive.resumable = true;
+		load_state();
+	}
+
+	void replication_job::add_link(const std::string& name, replication_link link) {
+		if (name.empty()) throw std::invalid_argument("link name must not be empty");
+		if (link.max_concurrency == 0) throw std::invalid_argument("max_concurrency must be greater than zero");
+		if (!link.connect) throw std::invalid_argument("link requires a connect function");
+		m_links[name] = std::move(link);
+	}
+
+	void replication_job::add(replication_task task) {
+		if (task.source.find('@') == std::string::npos) throw std::invalid_argument("source must be a snapshot");
+		if (task.target.empty()) throw std::invalid_argument("target must not be empty");
+		m_tasks.push_back(std::move(task));
+	}
+
+	void replication_job::load_state() {
+		if (m_options.state_file.empty()) return;
+		int fd = open(m_options.state_file.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && errno == ENOENT) return;
+		if (fd < 0) throw std::system_error(errno, std::system_category());
+		std::string data;
+		char buf[4096];
+		while (true) {
+			auto res = read(fd, buf, sizeof(buf));
+			if (res < 0 && errno == EINTR) continue;
+			if (res < 0) {
+				auto err = errno;
+				::close(fd);
+				throw std::system_error(err, std::system_category());
+			}
+			if (res == 0) break;
+			data.append(buf, res);
+		}
+		::close(fd);
+
+		// One "target<TAB>token" pair per line, neither can contain whitespace
+		std::string_view view{data};
+		while (!view.empty()) {
+			auto end = view.find('\n');
+			if (end == std::string_view::npos) end = view.size();
+			auto line = view.substr(0, end);
+			auto sep = line.find('\t');
+			if (sep != std::string_view::npos && sep != 0 && sep + 1 < line.size())
+				m_tokens[std::string{line.substr(0, sep)}] = std::string{line.substr(sep + 1)};
+			view.remove_prefix(std::min(end + 1, view.size()));
+		}
+	}
+
+	void replication_job::save_state() {
+		if (m_options.state_file.empty()) return;
+		std::string data;
+		for (auto& e : m_tokens)
+			data += e.first + '\t' + e.second + '\n';
+
+		// Replace the file atomically, so a crash never loses tokens that were already persisted
+		auto tmp = m_options.state_file + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0) throw std::system_error(errno, std::system_category());
+		try {
+			write_all(fd, data);
+			if (fsync(fd) != 0) throw std::system_error(errno, std::system_category());
+		} catch (...) {
+			::close(fd);
+			unlink(tmp.c_str());
+			throw;
+		}
+		::close(fd);
+		if (rename(tmp.c_str(), m_options.state_file.c_str()) != 0) {
+			auto err = errno;
+			unlink(tmp.c_str());
+			throw std::system_error(err, std::system_category());
+		}
+	}
+
+	void replication_job::set_token(const std::string& target, const std::string& token) {
+		std::unique_lock<std::mutex> lck{m_state_mtx};
+		auto it = m_tokens.find(target);
+		if (token.empty()) {
+			if (it == m_tokens.end()) return;
+			m_tokens.erase(it);
+		} else {
+			if (it != m_tokens.end() && it->second == token) return;
+			m_tokens[target] = token;
+		}
+		save_state();
+	}
+
+	std::string replication_job::query_token(zfs& client, const replication_task& task) {
+		if (task.link.empty()) {
+			try {
+				return client.open_dataset(task.target, dataset_type::filesystem | dataset_type::volume)
+					.receive_resume_token();
+			} catch (const std::system_error& e) {
+				if (e.code() == std::error_code(EZFS_NOENT, zfs_category())) return "";
+				throw;
+			}
+		}
+		auto& link = m_links.at(task.link);
+		if (link.resume_token) return link.resume_token(task);
+		std::unique_lock<std::mutex> lck{m_state_mtx};
+		auto it = m_tokens.find(task.target);
+		return it == m_tokens.end() ? "" : it->second;
+	}
+
+	void replication_job::abort_resume(zfs& client, const replication_task& task) {
+		if (!task.link.empty()) {
+			auto& link = m_links.at(task.link);
+			if (!link.abort_resume)
+				throw std::runtime_error("target " + task.target + " holds a partial receive of another stream");
+			link.abort_resume(task);
+			return;
+		}
+		// Like zfs receive -A, an existing target keeps the partial state in a hidden child, a new one is it
+		auto partial = task.target + "/%recv";
+		auto types = static_cast<zfs_type_t>(dataset_type::filesystem | dataset_type::volume);
+		bool hidden;
+		{
+			std::unique_lock<zfs> lck{client};
+			hidden = zfs_dataset_exists(client.raw(), partial.c_str(), types);
+			// A token kept in the state file can outlive the target
+			if (!hidden && !zfs_dataset_exists(client.raw(), task.target.c_str(), types)) return;
+		}
+		auto ds = client.open_dataset(hidden ? partial : task.target, dataset_type::filesystem | dataset_type::volume);
+		bool inconsistent;
+		{
+			std::unique_lock<zfs> lck{client};
+			inconsistent = zfs_prop_get_int(ds.raw(), ZFS_PROP_INCONSISTENT) != 0;
+		}
+		if (hidden || inconsistent) ds.destroy();
+	}
+
+	send_progress replication_job::stream(zfs& send_client, zfs& recv_client, const replication_task& task,
+										  const std::string& token, const send_options& options) {
+		auto send = [&](int fd) {
+			if (!token.empty()) return send_client.send_resume(token, fd, options);
+			return send_client.open_dataset(task.source, dataset_type::snapshot).send(fd, options);
+		};
+
+		if (!task.link.empty()) {
+			auto& link = m_links.at(task.link);
+			int fd = link.connect(task);
+			if (fd < 0) throw std::system_error(errno, std::system_category());
+			send_progress progress;
+			try {
+				progress = send(fd);
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			::close(fd);
+			if (link.complete) link.complete(task);
+			return progress;
+		}
+
+		// Local receives run on a second client, zfs_receive holds its lock for the whole stream
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) != 0) throw std::system_error(errno, std::system_category());
+		std::exception_ptr recv_error;
+		std::thread receiver;
+		try {
+			receiver = std::thread([&]() {
+				try {
+					recv_client.receive(task.target, fds[0], m_options.receive);
+				} catch (...) { recv_error = std::current_exception(); }
+				// Makes the sender fail with EPIPE if the receive ended early
+				::close(fds[0]);
+			});
+		} catch (...) {
+			::close(fds[0]);
+			::close(fds[1]);
+			throw;
+		}
+
+		send_progress progress{};
+		std::exception_ptr send_error;
+		try {
+			progress = send(fds[1]);
+		} catch (...) { send_error = std::current_exception(); }
+		::close(fds[1]);
+		receiver.join();
+
+		// A broken pipe only tells that the receive failed, its own error is more useful
+		if (send_error && !(recv_error && is_broken_pipe(send_error))) std::rethrow_exception(send_error);
+		if (recv_error) std::rethrow_exception(recv_error);
+		return progress;
+	}
+
+	void replication_job::run_task(zfs& send_client, zfs& recv_client, replication_result& result) {
+		auto& task = result.task;
+		auto options = m_options.send;
+		options.from = task.from;
+		options.intermediates = options.intermediates && !task.from.empty();
+		options.on_progress = [&](const send_progress& progress) {
+			result.bytes_sent = progress.bytes_written;
+			if (m_options.on_progress) m_options.on_progress(task, progress);
+		};
+
+		std::string token;
+		try {
+			token = query_token(recv_client, task);
+		} catch (...) {
+			// The receiver is not reachable right now, try what the last run left behind
+			std::unique_lock<std::mutex> lck{m_state_mtx};
+			auto it = m_tokens.find(task.target);
+			if (it != m_tokens.end()) token = it->second;
+		}
+
+		for (size_t attempt = 0;; attempt++) {
+			result.error = nullptr;
+			std::string resumed;
+			if (!token.empty()) {
+				resumed = resumed_snapshot(send_client, task, options.intermediates, token);
+				if (resumed.empty()) {
+					try {
+						abort_resume(recv_client, task);
+					} catch (...) {
+						result.error = std::current_exception();
+						return;
+					}
+					token.clear();
+					set_token(task.target, "");
+				}
+			}
+			result.resumed = result.resumed || !token.empty();
+			try {
+				auto progress = stream(send_client, recv_client, task, token, options);
+				result.bytes_sent = progress.bytes_written;
+				set_token(task.target, "");
+				if (token.empty() || resumed == task.source) return;
+				// The resumed substream of -I ended before the requested snapshot, send the rest from there
+				options.from = resumed;
+				token.clear();
+				continue;
+			} catch (...) { result.error = std::current_exception(); }
+
+			// Pick up where the receiver stopped, if it kept the partial state
+			try {
+				token = query_token(recv_client, task);
+				set_token(task.target, token);
+			} catch (...) {
+				// Keep the previous token, the stream error is reported instead
+			}
+			if (token.empty() || attempt >= m_options.retries) return;
+		}
+	}
+
+	std::vector<replication_result> replication_job::run() {
+		for (auto& task : m_tasks) {
+			if (!task.link.empty() && m_links.count(task.link) == 0)
+				throw std::invalid_argument("unknown replication link " + task.link);
+		}
+
+		std::vector<replication_result> results(m_tasks.size());
+		if (m_tasks.empty()) return results;
+		std::vector<size_t> order(m_tasks.size());
+		size_t nworkers = std::min(m_options.max_concurrency, m_tasks.size());
+		std::vector<std::unique_ptr<zfs>> clients;
+		for (size_t i = 0; i < nworkers * 2; i++)
+			clients.emplace_back(new zfs());
+
+		for (size_t i = 0; i < m_tasks.size(); i++) {
+			auto& result = results[i];
+			result.task = m_tasks[i];
+			order[i] = i;
+			send_options options = m_options.send;
+			options.from = result.task.from;
+			options.intermediates = false;
+			try {
+				result.estimated_size =
+					clients[0]->open_dataset(result.task.source, dataset_type::snapshot).send_space(options);
+			} catch (const std::system_error&) {
+				// Errors are reported once the task is run
+			}
+		}
+		// Starting the largest streams first keeps a single big one from trailing behind at the end
+		std::stable_sort(order.begin(), order.end(),
+						 [&](size_t a, size_t b) { return results[a].estimated_size > results[b].estimated_size; });
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<bool> started(m_tasks.size());
+		std::map<std::string, size_t> pool_load;
+		std::map<std::string, size_t> link_load;
+		bool aborted = false;
+
+		auto pools_of = [](const replication_task& task) {
+			std::vector<std::string> res{pool_of(task.source)};
+			if (task.link.empty() && pool_of(task.target) != res[0]) res.push_back(pool_of(task.target));
+			return res;
+		};
+		auto eligible = [&](const replication_task& task) {
+			if (!task.link.empty() && link_load[task.link] >= m_links.at(task.link).max_concurrency) return false;
+			if (m_options.max_per_pool == 0) return true;
+			for (auto& p : pools_of(task)) {
+				if (pool_load[p] >= m_options.max_per_pool) return false;
+			}
+			return true;
+		};
+		auto worker = [&](zfs& send_client, zfs& recv_client) {
+			std::unique_lock<std::mutex> lck{mtx};
+			while (!aborted) {
+				bool pending = false;
+				size_t pick = order.size();
+				for (auto idx : order) {
+					if (started[idx]) continue;
+					pending = true;
+					if (eligible(results[idx].task)) {
+						pick = idx;
+						break;
+					}
+				}
+				if (!pending) break;
+				if (pick == order.size()) {
+					cv.wait(lck);
+					continue;
+				}
+
+				auto& task = results[pick].task;
+				started[pick] = true;
+				if (!task.link.empty()) link_load[task.link]++;
+				for (auto& p : pools_of(task))
+					pool_load[p]++;
+				lck.unlock();
+				try {
+					run_task(send_client, recv_client, results[pick]);
+				} catch (...) { results[pick].error = std::current_exception(); }
+				lck.lock();
+				if (!task.link.empty()) link_load[task.link]--;
+				for (auto& p : pools_of(task))
+					pool_load[p]--;
+				cv.notify_all();
+			}
+		};
+
+		std::vector<std::thread> workers;
+		try {
+			for (size_t i = 0; i < nworkers; i++) {
+				auto& send_client = *clients[i * 2];
+				auto& recv_client = *clients[i * 2 + 1];
+				workers.emplace_back([&worker, &send_client, &recv_client]() { worker(send_client, recv_client); });
+			}
+		} catch (...) {
+			{
+				std::unique_lock<std::mutex> lck{mtx};
+				aborted = true;
+				cv.notify_all();
+			}
+			for (auto& e : workers)
+				e.join();
+			throw;
+		}
+		for (auto& e : workers)
+			e.join();
+		return results;
+	}
+
+} // namespace zfspp
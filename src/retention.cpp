@@ -0,0 +1,186 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <libzfs.h>
+#include <libzfs_core.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		struct list_data {
+			std::vector<snapshot_info> result;
+			bool recursive;
+			bool alloc_failed = false;
+
+			static int snapshot_cb(zfs_handle_t* hdl, void* udata) {
+				auto ptr = static_cast<list_data*>(udata);
+				if (!ptr->alloc_failed) {
+					try {
+						// Both properties are part of the stats fetched while iterating, no extra ioctl is needed
+						ptr->result.push_back(snapshot_info{zfs_get_name(hdl), zfs_prop_get_int(hdl, ZFS_PROP_CREATION),
+															zfs_prop_get_int(hdl, ZFS_PROP_USERREFS), {}});
+					} catch (...) {
+						ptr->alloc_failed = true;
+					}
+				}
+				zfs_close(hdl);
+				return 0;
+			}
+
+			static int filesystem_cb(zfs_handle_t* hdl, void* udata) {
+				auto ptr = static_cast<list_data*>(udata);
+				zfs_iter_snapshots(hdl, B_FALSE, snapshot_cb, udata, 0, 0);
+				if (ptr->recursive && !ptr->alloc_failed) zfs_iter_filesystems(hdl, filesystem_cb, udata);
+				zfs_close(hdl);
+				return 0;
+			}
+		};
+
+		struct bucket_rule {
+			size_t remaining;
+			int64_t period;
+			int64_t shift;
+			int64_t last;
+			bool any;
+
+			bool select(int64_t time) {
+				if (remaining == 0) return false;
+				// Floor division, so times before the epoch end up in the right bucket as well
+				auto t = time + shift;
+				auto bucket = t / period - (t % period < 0 ? 1 : 0);
+				if (any && bucket == last) return false;
+				any = true;
+				last = bucket;
+				remaining--;
+				return true;
+			}
+		};
+	} // namespace
+
+	std::vector<snapshot_info> zfs::list_snapshots(const std::string& root, bool recursive, bool with_holds) {
+		list_data data{{}, recursive};
+		{
+			std::unique_lock<std::recursive_mutex> lck{m_mutex};
+			auto hdl = zfs_open(m_handle, root.c_str(), ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+			if (hdl == nullptr) throw std::system_error(libzfs_errno(m_handle), zfs_category());
+			list_data::filesystem_cb(hdl, &data);
+		}
+		if (data.alloc_failed) throw std::bad_alloc();
+
+		if (with_holds) {
+			for (auto& e : data.result) {
+				if (e.userrefs == 0) continue;
+				::nvlist* holds{};
+				auto err = lzc_get_holds(e.name.c_str(), &holds);
+				// The snapshot might have been destroyed since it was listed
+				if (err == ENOENT) continue;
+				if (err != 0) throw std::system_error(err, std::system_category());
+				nv_list list{holds, nv_list::adopt_list{}};
+				for (auto& tag : list)
+					e.holds.push_back(tag.key());
+			}
+		}
+		return std::move(data.result);
+	}
+
+	retention_plan plan_retention(const retention_policy& policy, const std::vector<snapshot_info>& snapshots) {
+		struct entry {
+			std::string_view dataset;
+			std::string_view snapshot;
+			const snapshot_info* info;
+		};
+
+		retention_plan plan{};
+		std::vector<entry> entries;
+		entries.reserve(snapshots.size());
+		for (auto& e : snapshots) {
+			std::string_view name{e.name};
+			auto pos = name.find('@');
+			if (pos == std::string_view::npos ||
+				name.substr(pos + 1).compare(0, policy.prefix.size(), policy.prefix) != 0) {
+				plan.kept++;
+				continue;
+			}
+			entries.push_back(entry{name.substr(0, pos), name.substr(pos + 1), &e});
+		}
+		// Group by dataset, newest first within each group
+		std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) {
+			if (a.dataset != b.dataset) return a.dataset < b.dataset;
+			if (a.info->creation != b.info->creation) return a.info->creation > b.info->creation;
+			return a.snapshot > b.snapshot;
+		});
+
+		const int64_t shift = policy.utc_offset.count();
+		// The epoch was a thursday, shifting by three days makes weeks start on monday
+		const int64_t week_shift = shift + 3 * 86400;
+		std::vector<const snapshot_info*> group;
+		size_t begin = 0;
+		while (begin < entries.size()) {
+			auto end = begin;
+			while (end < entries.size() && entries[end].dataset == entries[begin].dataset)
+				end++;
+
+			size_t last = policy.keep_last;
+			bucket_rule rules[] = {
+				{policy.hourly, 3600, shift, 0, false},
+				{policy.daily, 86400, shift, 0, false},
+				{policy.weekly, 7 * 86400, week_shift, 0, false},
+			};
+			group.clear();
+			for (auto i = begin; i < end; i++) {
+				auto info = entries[i].info;
+				bool keep = false;
+				if (last != 0) {
+					last--;
+					keep = true;
+				}
+				// Every rule has to see every snapshot to advance its buckets
+				for (auto& r : rules)
+					keep = r.select(static_cast<int64_t>(info->creation)) || keep;
+				if (policy.keep_held && info->userrefs != 0) keep = true;
+				if (!keep && !policy.hold_tags.empty()) {
+					for (auto& tag : info->holds) {
+						if (policy.hold_tags.count(tag) == 0) continue;
+						keep = true;
+						break;
+					}
+				}
+				if (keep)
+					plan.kept++;
+				else
+					group.push_back(info);
+			}
+			for (auto it = group.rbegin(); it != group.rend(); ++it)
+				plan.destroy.push_back((*it)->name);
+			begin = end;
+		}
+		return plan;
+	}
+
+	std::string retention_plan::compact() const {
+		std::string res;
+		std::string_view current;
+		for (auto& e : destroy) {
+			std::string_view name{e};
+			auto pos = name.find('@');
+			if (pos == std::string_view::npos) continue;
+			if (!current.empty() && name.substr(0, pos) == current) {
+				res += ',';
+				res += name.substr(pos + 1);
+				continue;
+			}
+			if (!current.empty()) res += '\n';
+			current = name.substr(0, pos);
+			res += name;
+		}
+		if (!current.empty()) res += '\n';
+		return res;
+	}
+
+} // namespace zfspp
@@ -0,0 +1,149 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		static_assert(static_cast<int>(scan_function::resilver) == POOL_SCAN_RESILVER, "scan_function mismatch");
+		static_assert(static_cast<int>(scan_state::canceled) == DSS_CANCELED, "scan_state mismatch");
+
+		uint64_t counter_delta(uint64_t current, uint64_t previous) noexcept {
+			return current >= previous ? current - previous : 0;
+		}
+	} // namespace
+
+	scan_stats pool::scan_progress() {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		boolean_t missing{};
+		if (zpool_refresh_stats(m_pool, &missing) != 0)
+			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		if (missing) throw std::system_error(EZFS_NOENT, zfs_category());
+		nvlist_t* root{};
+		auto config = zpool_get_config(m_pool, nullptr);
+		if (config == nullptr || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &root) != 0)
+			throw std::system_error(EZFS_INVALCONFIG, zfs_category());
+
+		// Pools that were never scanned have no scan stats at all
+		scan_stats res{};
+		uint64_t* array{};
+		uint_t count{};
+		if (nvlist_lookup_uint64_array(root, ZPOOL_CONFIG_SCAN_STATS, &array, &count) != 0) return res;
+		pool_scan_stat_t ps{};
+		memcpy(&ps, array, std::min(sizeof(ps), count * sizeof(uint64_t)));
+
+		// Newer kernels know more functions and states (e.g. error scrubs) than the enums, those stay none
+		if (ps.pss_func <= static_cast<uint64_t>(scan_function::resilver))
+			res.function = static_cast<scan_function>(ps.pss_func);
+		if (ps.pss_state <= static_cast<uint64_t>(scan_state::canceled))
+			res.state = static_cast<scan_state>(ps.pss_state);
+		res.start_time = ps.pss_start_time;
+		res.end_time = ps.pss_end_time;
+		res.to_examine = ps.pss_to_examine;
+		res.examined = ps.pss_examined;
+		res.issued = ps.pss_issued;
+		res.processed = ps.pss_processed;
+		res.errors = ps.pss_errors;
+		res.pass_start = ps.pss_pass_start;
+		res.pass_examined = ps.pss_pass_exam;
+		res.pass_issued = ps.pss_pass_issued;
+		res.pass_paused_at = ps.pss_pass_scrub_pause;
+		res.pass_paused_time = ps.pss_pass_scrub_spent_paused;
+		return res;
+	}
+
+	void pool::start_scan(scan_function fn) {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		if (fn == scan_function::none) throw std::invalid_argument("scan function must not be none");
+		std::unique_lock<zfs> lck{*m_parent};
+		if (zpool_scan(m_pool, static_cast<pool_scan_func_t>(fn), POOL_SCRUB_NORMAL) != 0)
+			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+	}
+
+	void pool::pause_scrub() {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		if (zpool_scan(m_pool, POOL_SCAN_SCRUB, POOL_SCRUB_PAUSE) != 0)
+			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+	}
+
+	void pool::cancel_scan() {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		if (zpool_scan(m_pool, POOL_SCAN_NONE, POOL_SCRUB_NORMAL) != 0)
+			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+	}
+
+	scan_monitor::scan_monitor(pool& p, std::chrono::seconds smoothing)
+		: m_pool(&p), m_smoothing(static_cast<double>(smoothing.count())) {
+		if (smoothing.count() <= 0) throw std::invalid_argument("smoothing must be greater than zero");
+	}
+
+	const scan_stats& scan_monitor::sample() {
+		auto cur = m_pool->scan_progress();
+		auto now = std::chrono::steady_clock::now();
+		bool same_pass = m_has_sample && m_stats.active() && cur.function == m_stats.function &&
+						 cur.start_time == m_stats.start_time && cur.pass_start == m_stats.pass_start;
+
+		if (!cur.active()) {
+			m_scan_rate = m_issue_rate = 0;
+		} else if (!same_pass) {
+			// Start with the average of the pass, like zpool status does
+			auto end = cur.paused() ? cur.pass_paused_at : static_cast<uint64_t>(time(nullptr));
+			auto elapsed = counter_delta(end, cur.pass_start + cur.pass_paused_time);
+			m_scan_rate = elapsed != 0 ? static_cast<double>(cur.pass_examined) / elapsed : 0;
+			m_issue_rate = elapsed != 0 ? static_cast<double>(cur.pass_issued) / elapsed : 0;
+		} else if (!cur.paused() && !m_stats.paused()) {
+			// Intervals which overlap a pause are skipped, they would drag the rates down
+			auto dt = std::chrono::duration<double>(now - m_time).count();
+			if (dt > 0) {
+				auto alpha = 1 - std::exp(-dt / m_smoothing);
+				auto scan = counter_delta(cur.examined, m_stats.examined) / dt;
+				auto issue = counter_delta(cur.issued, m_stats.issued) / dt;
+				m_scan_rate += alpha * (scan - m_scan_rate);
+				m_issue_rate += alpha * (issue - m_issue_rate);
+			}
+		}
+		m_stats = cur;
+		m_time = now;
+		m_has_sample = true;
+		return m_stats;
+	}
+
+	double scan_monitor::progress() const noexcept {
+		if (m_stats.state == scan_state::finished) return 1;
+		if (m_stats.to_examine == 0) return 0;
+		return std::min(1.0, static_cast<double>(m_stats.issued) / m_stats.to_examine);
+	}
+
+	std::chrono::seconds scan_monitor::eta() const noexcept {
+		if (!m_stats.active() || m_stats.paused() || m_issue_rate < 1) return std::chrono::seconds::max();
+		auto remaining = counter_delta(m_stats.to_examine, m_stats.issued);
+		auto secs = std::ceil(remaining / m_issue_rate);
+		if (secs >= static_cast<double>(std::chrono::seconds::max().count())) return std::chrono::seconds::max();
+		return std::chrono::seconds{static_cast<std::chrono::seconds::rep>(secs)};
+	}
+
+	void scan_monitor::start(scan_function fn) {
+		m_pool->start_scan(fn);
+		m_has_sample = false;
+	}
+
+	void scan_monitor::pause() { m_pool->pause_scrub(); }
+
+	void scan_monitor::cancel() {
+		m_pool->cancel_scan();
+		m_scan_rate = m_issue_rate = 0;
+		m_has_sample = false;
+	}
+
+} // namespace zfspp
@@ -0,0 +1,556 @@
+#include "zfspp.h"
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include <libzfs.h>
+#include <libzfs_core.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		constexpr size_t pipe_size = 1 << 20;
+
+		/**
+		 * Block SIGPIPE for the current thread while writing into fds the reader might close.
+		 * A SIGPIPE generated while the guard is active is consumed instead of being delivered on unblock.
+		 */
+		class sigpipe_guard {
+			sigset_t m_old;
+			bool m_was_pending{};
+
+		public:
+			sigpipe_guard() {
+				sigset_t set, pending;
+				sigemptyset(&set);
+				sigaddset(&set, SIGPIPE);
+				sigpending(&pending);
+				m_was_pending = sigismember(&pending, SIGPIPE) == 1;
+				pthread_sigmask(SIG_BLOCK, &set, &m_old);
+			}
+			sigpipe_guard(const sigpipe_guard&) = delete;
+			sigpipe_guard& operator=(const sigpipe_guard&) = delete;
+			~sigpipe_guard() {
+				sigset_t set, pending;
+				sigemptyset(&set);
+				sigaddset(&set, SIGPIPE);
+				sigpending(&pending);
+				if (!m_was_pending && sigismember(&pending, SIGPIPE) == 1) {
+					timespec ts{};
+					sigtimedwait(&set, nullptr, &ts);
+				}
+				pthread_sigmask(SIG_SETMASK, &m_old, nullptr);
+			}
+		};
+
+		struct fd_pair {
+			int rd{-1};
+			int wr{-1};
+
+			fd_pair() {
+				int fds[2];
+				if (pipe2(fds, O_CLOEXEC) != 0) throw std::system_error(errno, std::system_category());
+				rd = fds[0];
+				wr = fds[1];
+				// Best effort, unprivileged processes are limited by /proc/sys/fs/pipe-max-size
+				fcntl(wr, F_SETPIPE_SZ, pipe_size);
+			}
+			fd_pair(const fd_pair&) = delete;
+			fd_pair& operator=(const fd_pair&) = delete;
+			~fd_pair() {
+				close_rd();
+				close_wr();
+			}
+
+			void close_rd() {
+				if (rd >= 0) ::close(rd);
+				rd = -1;
+			}
+			void close_wr() {
+				if (wr >= 0) ::close(wr);
+				wr = -1;
+			}
+		};
+
+		bool is_pipe_or_socket(int fd) {
+			struct stat st {};
+			if (fstat(fd, &st) != 0) throw std::system_error(errno, std::system_category());
+			return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+		}
+
+		lzc_send_flags to_lzc_flags(const send_options& options) {
+			int flags = 0;
+			if (options.embedded) flags |= LZC_SEND_FLAG_EMBED_DATA;
+			if (options.large_blocks) flags |= LZC_SEND_FLAG_LARGE_BLOCK;
+			if (options.compressed) flags |= LZC_SEND_FLAG_COMPRESS;
+			if (options.raw) flags |= LZC_SEND_FLAG_RAW;
+			return static_cast<lzc_send_flags>(flags);
+		}
+
+		std::string short_snapshot_name(const std::string& name) {
+			auto pos = name.find('@');
+			if (pos == std::string::npos) throw std::invalid_argument("not a snapshot: " + name);
+			return name.substr(pos + 1);
+		}
+
+		std::string resolve_incremental_source(const std::string& snapname, const std::string& from) {
+			if (from.empty() || (from[0] != '@' && from[0] != '#')) return from;
+			return snapname.substr(0, snapname.find('@')) + from;
+		}
+
+		/**
+		 * Run fn on a helper thread with SIGPIPE blocked, so the kernel side of a stream
+		 * fails with EPIPE instead of killing the process if the other end goes away.
+		 */
+		template<typename TFunc>
+		std::future<std::error_code> run_stream_thread(TFunc&& fn) {
+			std::promise<std::error_code> promise;
+			auto res = promise.get_future();
+			std::thread([fn, promise = std::move(promise)]() mutable {
+				sigset_t set;
+				sigemptyset(&set);
+				sigaddset(&set, SIGPIPE);
+				pthread_sigmask(SIG_BLOCK, &set, nullptr);
+				try {
+					promise.set_value(fn());
+				} catch (...) { promise.set_exception(std::current_exception()); }
+			}).detach();
+			return res;
+		}
+
+		/**
+		 * Reads the source fd ahead on one thread into large aligned buffers while a second thread
+		 * feeds them into a pipe read by the kernel, so short gaps on the source do not stall the receive.
+		 * Buffers are handed over early while the kernel is starved to keep latency low on slow sources.
+		 */
+		class prefetch_reader {
+			struct free_deleter {
+				void operator()(char* ptr) const noexcept { free(ptr); }
+			};
+			using clock = std::chrono::steady_clock;
+
+			int m_source;
+			size_t m_buffer_size;
+			std::vector<std::unique_ptr<char, free_deleter>> m_buffers;
+			std::vector<size_t> m_lengths;
+			fd_pair m_pipe;
+			int m_stopfd{-1};
+
+			std::mutex m_mtx;
+			std::condition_variable m_cv;
+			size_t m_head{};
+			size_t m_filled{};
+			bool m_eof{};
+			bool m_stop{};
+			std::atomic<bool> m_writer_waiting{};
+			int m_error{};
+
+			uint64_t m_bytes{};
+			clock::duration m_input_stall{};
+			clock::duration m_output_stall{};
+
+			std::thread m_reader;
+			std::thread m_writer;
+
+			void stop(int error) {
+				std::unique_lock<std::mutex> lck{m_mtx};
+				if (error != 0 && m_error == 0) m_error = error;
+				m_stop = true;
+				uint64_t val = 1;
+				if (write(m_stopfd, &val, sizeof(val)) < 0) {}
+				m_cv.notify_all();
+			}
+
+			void reader_fn() {
+				const size_t n = m_buffers.size();
+				while (true) {
+					size_t slot;
+					{
+						std::unique_lock<std::mutex> lck{m_mtx};
+						auto start = clock::now();
+						m_cv.wait(lck, [this, n]() { return m_stop || m_filled < n; });
+						m_output_stall += clock::now() - start;
+						if (m_stop) return;
+						slot = (m_head + m_filled) % n;
+					}
+					// Only this thread touches slots past the filled range, so fill without the lock
+					auto buf = m_buffers[slot].get();
+					size_t len = 0;
+					bool eof = false;
+					while (len < m_buffer_size) {
+						pollfd pfd[2]{};
+						pfd[0].fd = m_source;
+						pfd[0].events = POLLIN;
+						pfd[1].fd = m_stopfd;
+						pfd[1].events = POLLIN;
+						if (poll(pfd, 2, -1) < 0) {
+							if (errno == EINTR) continue;
+							return stop(errno);
+						}
+						if (pfd[1].revents != 0) return;
+						auto res = read(m_source, buf + len, m_buffer_size - len);
+						if (res < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+						if (res < 0) return stop(errno);
+						if (res == 0) {
+							eof = true;
+							break;
+						}
+						len += res;
+						if (m_writer_waiting.load(std::memory_order_relaxed)) break;
+					}
+					std::unique_lock<std::mutex> lck{m_mtx};
+					m_lengths[slot] = len;
+					m_bytes += len;
+					if (len != 0) m_filled++;
+					m_eof = eof;
+					m_cv.notify_all();
+					if (eof) return;
+				}
+			}
+
+			void writer_fn() {
+				sigset_t set;
+				sigemptyset(&set);
+				sigaddset(&set, SIGPIPE);
+				pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+				const size_t n = m_buffers.size();
+				while (true) {
+					size_t slot;
+					{
+						std::unique_lock<std::mutex> lck{m_mtx};
+						if (m_filled == 0 && !m_eof && !m_stop) {
+							m_writer_waiting = true;
+							auto start = clock::now();
+							m_cv.wait(lck, [this]() { return m_stop || m_eof || m_filled != 0; });
+							m_input_stall += clock::now() - start;
+							m_writer_waiting = false;
+						}
+						if (m_stop || m_filled == 0) break;
+						slot = m_head;
+					}
+					auto buf = m_buffers[slot].get();
+					size_t len = m_lengths[slot];
+					size_t off = 0;
+					while (off < len) {
+						auto res = write(m_pipe.wr, buf + off, len - off);
+						if (res < 0 && errno == EINTR) continue;
+						// EPIPE means the kernel is done with the stream, anything else is a real error
+						if (res < 0) return stop(errno == EPIPE ? 0 : errno);
+						off += res;
+					}
+					std::unique_lock<std::mutex> lck{m_mtx};
+					m_head = (m_head + 1) % n;
+					m_filled--;
+					m_cv.notify_all();
+				}
+				// Signal EOF to the kernel
+				std::unique_lock<std::mutex> lck{m_mtx};
+				m_pipe.close_wr();
+			}
+
+		public:
+			prefetch_reader(int source, size_t buffer_size, size_t buffer_count)
+				: m_source(source), m_buffer_size(buffer_size), m_lengths(buffer_count) {
+				if (buffer_size == 0) throw std::invalid_argument("buffer_size must be greater than zero");
+				m_buffers.reserve(buffer_count);
+				for (size_t i = 0; i < buffer_count; i++) {
+					void* ptr{};
+					if (posix_memalign(&ptr, 4096, buffer_size) != 0) throw std::bad_alloc();
+					m_buffers.emplace_back(static_cast<char*>(ptr));
+				}
+				m_stopfd = eventfd(0, EFD_CLOEXEC);
+				if (m_stopfd < 0) throw std::system_error(errno, std::system_category());
+			}
+			prefetch_reader(const prefetch_reader&) = delete;
+			prefetch_reader& operator=(const prefetch_reader&) = delete;
+			~prefetch_reader() {
+				finish();
+				::close(m_stopfd);
+			}
+
+			int fd() const noexcept { return m_pipe.rd; }
+			int error() const noexcept { return m_error; }
+			uint64_t bytes() const noexcept { return m_bytes; }
+			clock::duration input_stall() const noexcept { return m_input_stall; }
+			clock::duration output_stall() const noexcept { return m_output_stall; }
+
+			void start() {
+				m_reader = std::thread([this]() { reader_fn(); });
+				try {
+					m_writer = std::thread([this]() { writer_fn(); });
+				} catch (...) {
+					finish();
+					throw;
+				}
+			}
+
+			void finish() {
+				// Unblocks a writer stuck in write() once the kernel stopped reading
+				m_pipe.close_rd();
+				stop(0);
+				if (m_reader.joinable()) m_reader.join();
+				if (m_writer.joinable()) m_writer.join();
+			}
+		};
+
+		sendflags_t to_send_flags(const send_options& options) {
+			sendflags_t flags{};
+			flags.embed_data = options.embedded ? B_TRUE : B_FALSE;
+			flags.largeblock = options.large_blocks ? B_TRUE : B_FALSE;
+			flags.compress = options.compressed ? B_TRUE : B_FALSE;
+			flags.raw = options.raw ? B_TRUE : B_FALSE;
+			return flags;
+		}
+
+		/**
+		 * Run the kernel side of a send on a helper thread and forward its output into fd.
+		 * Pipe and socket sinks are fed through splice() from an internal pipe, everything else is
+		 * written directly by the kernel and only observed for progress.
+		 */
+		send_progress stream_send(int fd, const send_options& options, uint64_t estimated_size,
+								  std::function<std::error_code(int)> kernel) {
+			send_progress progress{};
+			progress.estimated_size = estimated_size;
+
+			const bool pump = options.use_splice && is_pipe_or_socket(fd);
+			std::unique_ptr<fd_pair> pipe;
+			if (pump) pipe.reset(new fd_pair());
+			// The write end is handed over to the sending thread, which closes it to signal EOF
+			const int out_fd = pump ? pipe->wr : fd;
+			const int owned_fd = pump ? pipe->wr : -1;
+			if (pump) pipe->wr = -1;
+
+			std::future<std::error_code> result;
+			try {
+				result = run_stream_thread([kernel, out_fd, owned_fd]() -> std::error_code {
+					struct closer {
+						int fd;
+						~closer() {
+							if (fd >= 0) ::close(fd);
+						}
+					} close_out{owned_fd};
+					return kernel(out_fd);
+				});
+			} catch (...) {
+				if (owned_fd >= 0) ::close(owned_fd);
+				throw;
+			}
+
+			auto last_report = std::chrono::steady_clock::now();
+			auto report = [&](bool force) {
+				if (!options.on_progress) return;
+				auto now = std::chrono::steady_clock::now();
+				if (!force && now - last_report < options.progress_interval) return;
+				last_report = now;
+				options.on_progress(progress);
+			};
+
+			int pump_error = 0;
+			if (pump) {
+				sigpipe_guard guard;
+				while (true) {
+					auto n = splice(pipe->rd, nullptr, fd, nullptr, pipe_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+					if (n < 0 && errno == EINTR) continue;
+					if (n < 0 && errno == EAGAIN) {
+						// Non-blocking sink, wait until it drained
+						pollfd pfd{};
+						pfd.fd = fd;
+						pfd.events = POLLOUT;
+						poll(&pfd, 1, -1);
+						continue;
+					}
+					if (n < 0) {
+						pump_error = errno;
+						break;
+					}
+					if (n == 0) break;
+					progress.bytes_written += n;
+					report(false);
+				}
+				// Closing our end makes the kernel stop with EPIPE if we bailed out early
+				pipe->close_rd();
+			} else {
+				auto start = lseek(fd, 0, SEEK_CUR);
+				try {
+					while (result.wait_for(options.progress_interval) != std::future_status::ready) {
+						if (start >= 0) progress.bytes_written = lseek(fd, 0, SEEK_CUR) - start;
+						report(true);
+					}
+				} catch (...) {
+					// The kernel writes into the caller's fd, which must not be in use past this call
+					result.wait();
+					throw;
+				}
+				if (start >= 0) progress.bytes_written = lseek(fd, 0, SEEK_CUR) - start;
+			}
+
+			auto err = result.get();
+			if (pump_error != 0) throw std::system_error(pump_error, std::system_category());
+			if (err) throw std::system_error(err);
+			report(true);
+			return progress;
+		}
+	} // namespace
+
+	uint64_t dataset::send_space(const send_options& options) const {
+		auto snapname = name();
+		auto from = resolve_incremental_source(snapname, options.from);
+		uint64_t res{};
+		// Bookmarks are accepted as incremental source by the kernel just like snapshots
+		auto err = lzc_send_space(snapname.c_str(), from.empty() ? nullptr : from.c_str(), to_lzc_flags(options), &res);
+		if (err != 0) throw std::system_error(err, std::system_category());
+		return res;
+	}
+
+	send_progress dataset::send(int fd, const send_options& options) {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
+		if (type() != dataset_type::snapshot) throw std::logic_error("only snapshots can be sent");
+		if (options.intermediates && options.from.empty())
+			throw std::invalid_argument("intermediates require an incremental source");
+		if (options.intermediates && options.from.find('#') != std::string::npos)
+			throw std::invalid_argument("intermediates can not be sent from a bookmark");
+
+		auto parent = m_parent;
+		auto snapname = name();
+		auto fsname = snapname.substr(0, snapname.find('@'));
+		auto from = resolve_incremental_source(snapname, options.from);
+		bool fromorigin = false;
+		if (options.intermediates) {
+			auto pos = from.find('@');
+			if (pos == std::string::npos) throw std::invalid_argument("not a snapshot: " + from);
+			// Like zfs send -I, a snapshot of another dataset is only accepted as the origin of this clone
+			if (from.substr(0, pos) != fsname) {
+				auto fs = parent->open_dataset(fsname, dataset_type::filesystem | dataset_type::volume);
+				char origin[ZFS_MAXPROPLEN]{};
+				{
+					std::unique_lock<zfs> lck{*parent};
+					if (zfs_prop_get(fs.raw(), ZFS_PROP_ORIGIN, origin, sizeof(origin), nullptr, nullptr, 0,
+									 B_FALSE) != 0)
+						origin[0] = '\0';
+				}
+				if (from != origin)
+					throw std::invalid_argument("incremental source must be in the same dataset or its origin: " + from);
+				fromorigin = true;
+			}
+		}
+
+		uint64_t estimate{};
+		try {
+			estimate = send_space(options);
+		} catch (const std::system_error&) {
+			// The estimate is informational only, the send itself reports real errors
+		}
+
+		auto intermediates = options.intermediates;
+		auto lzc_flags = to_lzc_flags(options);
+		auto flags = to_send_flags(options);
+		flags.doall = B_TRUE;
+		flags.fromorigin = fromorigin ? B_TRUE : B_FALSE;
+		return stream_send(fd, options, estimate, [=](int out_fd) -> std::error_code {
+			if (!intermediates) {
+				auto err = lzc_send_resume_redacted(snapname.c_str(), from.empty() ? nullptr : from.c_str(), out_fd,
+													lzc_flags, 0, 0, nullptr);
+				return std::error_code(err, std::system_category());
+			}
+			// -I produces a compound stream with one substream per snapshot, which only libzfs can assemble
+			auto fromsnap = short_snapshot_name(from);
+			auto tosnap = short_snapshot_name(snapname);
+			std::unique_lock<zfs> lck{*parent};
+			auto fs = zfs_open(parent->raw(), fsname.c_str(), ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+			if (fs == nullptr) return std::error_code(libzfs_errno(parent->raw()), zfs_category());
+			auto sflags = flags;
+			// With fromorigin libzfs starts at the origin on its own and expects no source snapshot
+			auto err = zfs_send(fs, sflags.fromorigin ? nullptr : fromsnap.c_str(), tosnap.c_str(), &sflags, out_fd,
+								nullptr, nullptr, nullptr);
+			std::error_code res;
+			if (err != 0) res = std::error_code(libzfs_errno(parent->raw()), zfs_category());
+			zfs_close(fs);
+			return res;
+		});
+	}
+
+	send_progress zfs::send_resume(const std::string& token, int fd, const send_options& options) {
+		auto flags = to_send_flags(options);
+		return stream_send(fd, options, 0, [this, token, flags](int out_fd) -> std::error_code {
+			std::unique_lock<std::recursive_mutex> lck{m_mutex};
+			auto sflags = flags;
+			// The token carries the snapshot, incremental source, offset and stream flags
+			if (zfs_send_resume(m_handle, &sflags, out_fd, token.c_str()) != 0)
+				return std::error_code(libzfs_errno(m_handle), zfs_category());
+			return {};
+		});
+	}
+
+	receive_stats zfs::receive(const std::string& target, int fd, const receive_options& options) {
+		auto props = options.properties;
+		for (auto& e : options.excluded_properties)
+			props.add_boolean(e.c_str());
+
+		recvflags_t flags{};
+		flags.force = options.force ? B_TRUE : B_FALSE;
+		flags.resumable = options.resumable ? B_TRUE : B_FALSE;
+		flags.nomount = options.nomount ? B_TRUE : B_FALSE;
+
+		receive_stats stats{};
+		std::unique_ptr<prefetch_reader> reader;
+		if (options.buffer_count != 0) {
+			reader.reset(new prefetch_reader(fd, options.buffer_size, options.buffer_count));
+			fd = reader->fd();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		if (reader) reader->start();
+		int res, error;
+		{
+			std::unique_lock<std::recursive_mutex> lck{m_mutex};
+			res = zfs_receive(m_handle, target.c_str(), props.raw(), &flags, fd, nullptr);
+			error = libzfs_errno(m_handle);
+		}
+		stats.elapsed = std::chrono::steady_clock::now() - start;
+		if (reader) {
+			reader->finish();
+			stats.bytes_received = reader->bytes();
+			stats.input_stall = reader->input_stall();
+			stats.output_stall = reader->output_stall();
+		}
+
+		// A failed read ends the stream early, so the kernel's error would only be a consequence of it
+		if (reader && reader->error() != 0) throw std::system_error(reader->error(), std::system_category());
+		if (res != 0) throw std::system_error(error, zfs_category());
+		return stats;
+	}
+
+	receive_stats dataset::receive(int fd, const receive_options& options) {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
+		return m_parent->receive(name(), fd, options);
+	}
+
+	std::string dataset::receive_resume_token() const {
+		if (m_hdl == nullptr) throw std::logic_error("invalid dataset handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		char buf[ZFS_MAXPROPLEN];
+		// The property only exists while a resumable receive is incomplete
+		if (zfs_prop_get(m_hdl.get(), ZFS_PROP_RECEIVE_RESUME_TOKEN, buf, sizeof(buf), nullptr, nullptr, 0,
+						 B_FALSE) != 0)
+			return "";
+		if (strcmp(buf, "-") == 0) return "";
+		return buf;
+	}
+
+} // namespace zfspp
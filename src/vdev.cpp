@@ -0,0 +1,326 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+#include <sys/nvpair.h>
+
+namespace zfspp {
+
+	namespace {
+		static_assert(latency_histogram_buckets == VDEV_L_HISTO_BUCKETS, "histogram size mismatch");
+		static_assert(static_cast<int>(vdev_state::healthy) == VDEV_STATE_HEALTHY, "vdev_state mismatch");
+
+		// Indexed by latency_histogram
+		constexpr const char* latency_histogram_names[latency_histogram_count] = {
+			ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,	 ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,
+			ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,	 ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,
+			ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,	 ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,
+			ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO, ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO,
+		};
+
+		enum class vdev_list {
+			tree,
+			cache,
+			spare,
+		};
+
+		template<typename TFunc>
+		void walk_vdev(nvlist_t* vdev, size_t parent, vdev_list list, size_t& next, TFunc& fn) {
+			auto self = next++;
+			fn(vdev, parent, list);
+			nvlist_t** children{};
+			uint_t nchildren{};
+			if (nvlist_lookup_nvlist_array(vdev, ZPOOL_CONFIG_CHILDREN, &children, &nchildren) != 0) return;
+			for (uint_t i = 0; i < nchildren; i++)
+				walk_vdev(children[i], self, list, next, fn);
+		}
+
+		/**
+		 * Visit every vdev of a vdev_tree in pre-order, followed by the l2cache and spare devices which
+		 * are kept outside of the tree. This order defines the vdev indices used in iostat samples and
+		 * vdev_tree. fn is called with the vdev, the index of its parent and the list it was found in.
+		 */
+		template<typename TFunc>
+		void walk_vdev_tree(nvlist_t* root, TFunc&& fn) {
+			size_t next = 0;
+			walk_vdev(root, vdev_tree::npos, vdev_list::tree, next, fn);
+			for (auto list : {vdev_list::cache, vdev_list::spare}) {
+				nvlist_t** devices{};
+				uint_t ndevices{};
+				auto key = list == vdev_list::cache ? ZPOOL_CONFIG_L2CACHE : ZPOOL_CONFIG_SPARES;
+				if (nvlist_lookup_nvlist_array(root, key, &devices, &ndevices) != 0) continue;
+				for (uint_t i = 0; i < ndevices; i++)
+					walk_vdev(devices[i], 0, list, next, fn);
+			}
+		}
+
+		size_t count_children(nvlist_t* vdev, bool is_root) noexcept {
+			size_t res = 0;
+			nvlist_t** children{};
+			uint_t n{};
+			for (auto key : {ZPOOL_CONFIG_CHILDREN, ZPOOL_CONFIG_L2CACHE, ZPOOL_CONFIG_SPARES}) {
+				if (nvlist_lookup_nvlist_array(vdev, key, &children, &n) == 0) res += n;
+				if (!is_root) break;
+			}
+			return res;
+		}
+
+		vdev_stat_t read_vdev_stat(nvlist_t* vdev) noexcept {
+			// Older kernels might provide a shorter vdev_stat_t
+			vdev_stat_t vs{};
+			uint64_t* array{};
+			uint_t count{};
+			if (nvlist_lookup_uint64_array(vdev, ZPOOL_CONFIG_VDEV_STATS, &array, &count) == 0)
+				memcpy(&vs, array, std::min(sizeof(vs), count * sizeof(uint64_t)));
+			return vs;
+		}
+
+		uint64_t read_vdev_iostat(nvlist_t* vdev, vdev_iostat& out, latency_histograms& latency) noexcept {
+			out.guid = 0;
+			nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_GUID, &out.guid);
+
+			auto vs = read_vdev_stat(vdev);
+			out.alloc = vs.vs_alloc;
+			out.space = vs.vs_space;
+			out.read_ops = vs.vs_ops[ZIO_TYPE_READ];
+			out.write_ops = vs.vs_ops[ZIO_TYPE_WRITE];
+			out.read_bytes = vs.vs_bytes[ZIO_TYPE_READ];
+			out.write_bytes = vs.vs_bytes[ZIO_TYPE_WRITE];
+			out.read_errors = vs.vs_read_errors;
+			out.write_errors = vs.vs_write_errors;
+			out.checksum_errors = vs.vs_checksum_errors;
+
+			nvlist_t* ex{};
+			if (nvlist_lookup_nvlist(vdev, ZPOOL_CONFIG_VDEV_STATS_EX, &ex) != 0) ex = nullptr;
+			uint64_t* array{};
+			uint_t count{};
+			for (size_t i = 0; i < latency_histogram_count; i++) {
+				auto& histo = latency[i];
+				count = 0;
+				if (ex != nullptr && nvlist_lookup_uint64_array(ex, latency_histogram_names[i], &array, &count) != 0)
+					count = 0;
+				auto n = std::min<size_t>(count, histo.size());
+				std::copy(array, array + n, histo.begin());
+				std::fill(histo.begin() + n, histo.end(), 0);
+			}
+			return static_cast<uint64_t>(vs.vs_timestamp);
+		}
+
+		uint64_t counter_delta(uint64_t current, uint64_t previous) noexcept {
+			// Counters only restart if the vdev was reopened, count from zero in that case
+			return current >= previous ? current - previous : current;
+		}
+	} // namespace
+
+	void pool::sample_iostat(iostat_sample& out) {
+		if (m_pool == nullptr || m_parent == nullptr) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{*m_parent};
+		boolean_t missing{};
+		if (zpool_refresh_stats(m_pool, &missing) != 0)
+			throw std::system_error(libzfs_errno(m_parent->raw()), zfs_category());
+		if (missing) throw std::system_error(EZFS_NOENT, zfs_category());
+		nvlist_t* root{};
+		auto config = zpool_get_config(m_pool, nullptr);
+		if (config == nullptr || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &root) != 0)
+			throw std::system_error(EZFS_INVALCONFIG, zfs_category());
+
+		size_t count = 0;
+		walk_vdev_tree(root, [&](nvlist_t* vdev, size_t, vdev_list) {
+			// Only grows if vdevs were added since the last sample
+			if (count == out.vdevs.size()) out.vdevs.emplace_back();
+			if (count == out.latency.size()) out.latency.emplace_back();
+			auto timestamp = read_vdev_iostat(vdev, out.vdevs[count], out.latency[count]);
+			if (count == 0) out.timestamp = timestamp;
+			count++;
+		});
+		out.vdevs.resize(count);
+		out.latency.resize(count);
+		out.interval = 0;
+	}
+
+	iostat_sampler::iostat_sampler(pool& p, size_t history, bool histograms)
+		: m_pool(&p), m_history(history), m_histograms(histograms) {
+		if (history == 0) throw std::invalid_argument("history must be greater than zero");
+	}
+
+	void iostat_sampler::reserve(size_t vdev_count) {
+		// Only runs for the first interval and if the topology changed, so sample() never allocates otherwise
+		for (auto& slot : m_history) {
+			slot.vdevs.resize(vdev_count);
+			if (m_histograms) slot.latency.resize(vdev_count);
+		}
+		// Without history histograms a single buffer is passed on to the most recent slot
+		if (!m_histograms) m_history[m_head].latency.resize(vdev_count);
+		m_vdev_count = vdev_count;
+	}
+
+	bool iostat_sampler::sample() {
+		m_pool->sample_iostat(m_current);
+		if (!m_has_previous) {
+			std::swap(m_current, m_previous);
+			m_has_previous = true;
+			return false;
+		}
+
+		auto cap = m_history.size();
+		if (m_current.vdevs.size() != m_vdev_count) reserve(m_current.vdevs.size());
+		auto& slot = m_history[(m_head + 1) % cap];
+		if (!m_histograms && &slot != &m_history[m_head]) slot.latency.swap(m_history[m_head].latency);
+		slot.timestamp = m_current.timestamp;
+		slot.interval = counter_delta(m_current.timestamp, m_previous.timestamp);
+		for (size_t i = 0; i < m_current.vdevs.size(); i++) {
+			auto& cur = m_current.vdevs[i];
+			auto& res = slot.vdevs[i];
+			auto& res_latency = slot.latency[i];
+			res = cur;
+			if (i >= m_previous.vdevs.size() || m_previous.vdevs[i].guid != cur.guid) {
+				// The topology changed, there is no baseline for this vdev
+				res.read_ops = res.write_ops = res.read_bytes = res.write_bytes = 0;
+				for (auto& h : res_latency)
+					h.fill(0);
+				continue;
+			}
+			auto& prev = m_previous.vdevs[i];
+			res.read_ops = counter_delta(cur.read_ops, prev.read_ops);
+			res.write_ops = counter_delta(cur.write_ops, prev.write_ops);
+			res.read_bytes = counter_delta(cur.read_bytes, prev.read_bytes);
+			res.write_bytes = counter_delta(cur.write_bytes, prev.write_bytes);
+			auto& cur_latency = m_current.latency[i];
+			auto& prev_latency = m_previous.latency[i];
+			for (size_t h = 0; h < latency_histogram_count; h++) {
+				for (size_t b = 0; b < latency_histogram_buckets; b++)
+					res_latency[h][b] = counter_delta(cur_latency[h][b], prev_latency[h][b]);
+			}
+		}
+		m_head = (m_head + 1) % cap;
+		m_size = std::min(m_size + 1, cap);
+		std::swap(m_current, m_previous);
+		return true;
+	}
+
+	const iostat_sample& iostat_sampler::at(size_t age) const {
+		if (age >= m_size) throw std::out_of_range("no sample of this age");
+		auto cap = m_history.size();
+		return m_history[(m_head + cap - age) % cap];
+	}
+
+	void iostat_sampler::clear() noexcept {
+		if (!m_histograms) m_history[0].latency.swap(m_history[m_head].latency);
+		m_has_previous = false;
+		m_head = 0;
+		m_size = 0;
+	}
+
+	bool vdev_tree::update(const nv_list& config) {
+		nvlist_t* root{};
+		if (config.raw() == nullptr || nvlist_lookup_nvlist(config.raw(), ZPOOL_CONFIG_VDEV_TREE, &root) != 0)
+			throw std::system_error(EZFS_INVALCONFIG, zfs_category());
+		return update_tree(root);
+	}
+
+	bool vdev_tree::update_tree(nvlist_t* root) {
+		const auto old_size = m_nodes.size();
+		bool changed = false;
+		size_t count = 0;
+		walk_vdev_tree(root, [&](nvlist_t* vdev, size_t parent, vdev_list list) {
+			auto idx = count++;
+			if (idx == m_nodes.size()) m_nodes.emplace_back();
+			auto& node = m_nodes[idx];
+
+			uint64_t guid{};
+			nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_GUID, &guid);
+			auto nchildren = count_children(vdev, parent == npos);
+			if (idx >= old_size || node.guid != guid || node.parent != parent || node.child_count != nchildren) {
+				// Type, ashift and role never change for a given guid, so they are only parsed for new nodes
+				changed = true;
+				node.guid = guid;
+				node.parent = parent;
+				node.child_count = nchildren;
+				char* type{};
+				if (nvlist_lookup_string(vdev, ZPOOL_CONFIG_TYPE, &type) == 0)
+					node.type = type;
+				else
+					node.type.clear();
+				uint64_t ashift{};
+				if (nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_ASHIFT, &ashift) != 0 && parent != npos)
+					ashift = m_nodes[parent].ashift;
+				node.ashift = ashift;
+				if (list == vdev_list::cache)
+					node.role = vdev_role::cache;
+				else if (list == vdev_list::spare)
+					node.role = vdev_role::spare;
+				else if (parent != 0)
+					node.role = parent == npos ? vdev_role::normal : m_nodes[parent].role;
+				else {
+					uint64_t is_log{};
+					char* bias{};
+					nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_IS_LOG, &is_log);
+					if (nvlist_lookup_string(vdev, ZPOOL_CONFIG_ALLOCATION_BIAS, &bias) != 0) bias = nullptr;
+					if (is_log)
+						node.role = vdev_role::log;
+					else if (bias != nullptr && strcmp(bias, "special") == 0)
+						node.role = vdev_role::special;
+					else if (bias != nullptr && strcmp(bias, "dedup") == 0)
+						node.role = vdev_role::dedup;
+					else
+						node.role = vdev_role::normal;
+				}
+			}
+
+			// Paths change when devices are renamed, state and aux with every fault
+			char* path{};
+			if (nvlist_lookup_string(vdev, ZPOOL_CONFIG_PATH, &path) != 0) path = nullptr;
+			if (path == nullptr && !node.path.empty()) {
+				node.path.clear();
+				changed = true;
+			} else if (path != nullptr && node.path != path) {
+				node.path = path;
+				changed = true;
+			}
+			auto vs = read_vdev_stat(vdev);
+			auto state = static_cast<vdev_state>(vs.vs_state);
+			if (node.state != state || node.aux != vs.vs_aux) {
+				node.state = state;
+				node.aux = vs.vs_aux;
+				changed = true;
+			}
+		});
+		if (count != old_size) changed = true;
+		m_nodes.resize(count);
+
+		// Children follow their parent, so a reverse pass sees every subtree before its root
+		for (auto& e : m_nodes)
+			e.subtree_size = 1;
+		for (size_t i = m_nodes.size(); i-- > 1;)
+			m_nodes[m_nodes[i].parent].subtree_size += m_nodes[i].subtree_size;
+		return changed;
+	}
+
+	bool vdev_tree::refresh(pool& p) {
+		if (!p.valid()) throw std::logic_error("invalid pool handle");
+		std::unique_lock<zfs> lck{p.client()};
+		boolean_t missing{};
+		if (zpool_refresh_stats(p.raw(), &missing) != 0)
+			throw std::system_error(libzfs_errno(p.client().raw()), zfs_category());
+		if (missing) throw std::system_error(EZFS_NOENT, zfs_category());
+		// Borrow the config owned by the handle instead of copying it into an nv_list
+		nvlist_t* root{};
+		auto config = zpool_get_config(p.raw(), nullptr);
+		if (config == nullptr || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &root) != 0)
+			throw std::system_error(EZFS_INVALCONFIG, zfs_category());
+		return update_tree(root);
+	}
+
+	size_t vdev_tree::find(uint64_t guid) const noexcept {
+		for (size_t i = 0; i < m_nodes.size(); i++) {
+			if (m_nodes[i].guid == guid) return i;
+		}
+		return npos;
+	}
+
+} // namespace zfspp
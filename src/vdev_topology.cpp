@@ -0,0 +1,177 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+
+#include <libzfs.h>
+#include <sys/fs/zfs.h>
+
+namespace zfspp {
+
+	namespace {
+		nv_list make_leaf(const std::string& path, bool is_file, uint64_t ashift) {
+			nv_list res;
+			res.add_string(ZPOOL_CONFIG_TYPE, is_file ? VDEV_TYPE_FILE : VDEV_TYPE_DISK);
+			res.add_string(ZPOOL_CONFIG_PATH, path.c_str());
+			if (ashift != 0) res.add_uint64(ZPOOL_CONFIG_ASHIFT, ashift);
+			return res;
+		}
+	} // namespace
+
+	void vdev_topology::add_group(const char* type, vdev_role role, const std::vector<std::string>& paths,
+								  uint64_t nparity, uint64_t ndata, uint64_t nspares) {
+		// Check everything before adding anything, so a failed call leaves the topology unchanged
+		std::set<std::string> added;
+		for (auto& e : paths) {
+			if (e.empty() || e[0] != '/') throw std::invalid_argument("device path must be absolute: " + e);
+			if (m_paths.count(e) != 0 || !added.insert(e).second)
+				throw std::invalid_argument("device used more than once: " + e);
+		}
+		std::vector<bool> is_file(paths.size());
+		for (size_t i = 0; i < paths.size(); i++) {
+			struct stat st {};
+			if (stat(paths[i].c_str(), &st) != 0) throw std::system_error(errno, std::system_category(), paths[i]);
+			if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode))
+				throw std::invalid_argument("not a block device or file: " + paths[i]);
+			is_file[i] = S_ISREG(st.st_mode);
+		}
+
+		m_groups.push_back(group{type, role, m_ashift, nparity, ndata, nspares, m_leaves.size(), paths.size()});
+		for (size_t i = 0; i < paths.size(); i++)
+			m_leaves.push_back(leaf{paths[i], is_file[i]});
+		m_paths.merge(added);
+	}
+
+	vdev_topology& vdev_topology::ashift(uint64_t value) {
+		if (value != 0 && (value < 9 || value > 16)) throw std::invalid_argument("ashift must be 0 or from 9 to 16");
+		m_ashift = value;
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::disk(const std::string& path, vdev_role role) {
+		if (role == vdev_role::cache || role == vdev_role::spare) throw std::invalid_argument("invalid vdev role");
+		add_group(VDEV_TYPE_DISK, role, {path});
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::mirror(const std::vector<std::string>& paths, vdev_role role) {
+		if (role == vdev_role::cache || role == vdev_role::spare) throw std::invalid_argument("invalid vdev role");
+		if (paths.size() < 2) throw std::invalid_argument("mirror requires at least two devices");
+		add_group(VDEV_TYPE_MIRROR, role, paths);
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::raidz(uint64_t parity, const std::vector<std::string>& paths, vdev_role role) {
+		if (role == vdev_role::cache || role == vdev_role::spare) throw std::invalid_argument("invalid vdev role");
+		if (parity < 1 || parity > 3) throw std::invalid_argument("raidz parity must be from 1 to 3");
+		if (paths.size() <= parity) throw std::invalid_argument("raidz requires more devices than parity");
+		add_group(VDEV_TYPE_RAIDZ, role, paths, parity);
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::draid(uint64_t parity, const std::vector<std::string>& paths, uint64_t data,
+										uint64_t spares) {
+		if (parity < 1 || parity > 3) throw std::invalid_argument("draid parity must be from 1 to 3");
+		if (paths.size() <= parity + spares) throw std::invalid_argument("draid requires more devices");
+		uint64_t available = paths.size() - spares - parity;
+		if (data == 0) data = std::min<uint64_t>(available, 8);
+		if (data > available) throw std::invalid_argument("draid has too few devices for the data count");
+		add_group(VDEV_TYPE_DRAID, vdev_role::normal, paths, parity, data, spares);
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::cache(const std::vector<std::string>& paths) {
+		if (paths.empty()) throw std::invalid_argument("cache requires at least one device");
+		add_group(VDEV_TYPE_DISK, vdev_role::cache, paths);
+		return *this;
+	}
+
+	vdev_topology& vdev_topology::spare(const std::vector<std::string>& paths) {
+		if (paths.empty()) throw std::invalid_argument("spare requires at least one device");
+		add_group(VDEV_TYPE_DISK, vdev_role::spare, paths);
+		return *this;
+	}
+
+	nv_list vdev_topology::build() const {
+		size_t ntop = 0;
+		size_t ncache = 0;
+		size_t nspare = 0;
+		bool has_normal = false;
+		for (auto& g : m_groups) {
+			if (g.role == vdev_role::cache)
+				ncache += g.count;
+			else if (g.role == vdev_role::spare)
+				nspare += g.count;
+			else
+				ntop++;
+			nspare += g.nspares;
+			has_normal = has_normal || g.role == vdev_role::normal;
+		}
+		if (!has_normal) throw std::invalid_argument("topology requires at least one normal vdev");
+
+		std::vector<nv_list> children;
+		std::vector<nv_list> caches;
+		std::vector<nv_list> spares;
+		std::vector<nv_list> leaves;
+		children.reserve(ntop);
+		caches.reserve(ncache);
+		spares.reserve(nspare);
+		for (auto& g : m_groups) {
+			if (g.role == vdev_role::cache || g.role == vdev_role::spare) {
+				auto& list = g.role == vdev_role::cache ? caches : spares;
+				for (size_t i = g.first; i < g.first + g.count; i++)
+					list.push_back(make_leaf(m_leaves[i].path, m_leaves[i].is_file, 0));
+				continue;
+			}
+
+			nv_list top;
+			if (strcmp(g.type, VDEV_TYPE_DISK) == 0) {
+				auto& l = m_leaves[g.first];
+				top = make_leaf(l.path, l.is_file, g.ashift);
+			} else {
+				leaves.clear();
+				leaves.reserve(g.count);
+				for (size_t i = g.first; i < g.first + g.count; i++)
+					leaves.push_back(make_leaf(m_leaves[i].path, m_leaves[i].is_file, g.ashift));
+				top.add_string(ZPOOL_CONFIG_TYPE, g.type);
+				top.add_nvlist_array(ZPOOL_CONFIG_CHILDREN, leaves.data(), leaves.size());
+			}
+			top.add_uint64(ZPOOL_CONFIG_IS_LOG, g.role == vdev_role::log ? 1 : 0);
+			if (g.role == vdev_role::special) top.add_string(ZPOOL_CONFIG_ALLOCATION_BIAS, VDEV_ALLOC_BIAS_SPECIAL);
+			if (g.role == vdev_role::dedup) top.add_string(ZPOOL_CONFIG_ALLOCATION_BIAS, VDEV_ALLOC_BIAS_DEDUP);
+			if (g.nparity != 0) top.add_uint64(ZPOOL_CONFIG_NPARITY, g.nparity);
+			if (strcmp(g.type, VDEV_TYPE_DRAID) == 0) {
+				// Smallest number of redundancy groups that fills every row of the devices evenly
+				uint64_t width = g.ndata + g.nparity;
+				uint64_t ngroups = 1;
+				while ((ngroups * width) % (g.count - g.nspares) != 0)
+					ngroups++;
+				top.add_uint64(ZPOOL_CONFIG_DRAID_NDATA, g.ndata);
+				top.add_uint64(ZPOOL_CONFIG_DRAID_NSPARES, g.nspares);
+				top.add_uint64(ZPOOL_CONFIG_DRAID_NGROUPS, ngroups);
+				// Distributed spares are named after parity, top-level vdev id and spare id
+				for (uint64_t s = 0; s < g.nspares; s++) {
+					nv_list dspare;
+					auto name = "draid" + std::to_string(g.nparity) + "-" + std::to_string(children.size()) + "-" +
+								std::to_string(s);
+					dspare.add_string(ZPOOL_CONFIG_TYPE, VDEV_TYPE_DRAID_SPARE);
+					dspare.add_string(ZPOOL_CONFIG_PATH, name.c_str());
+					spares.push_back(std::move(dspare));
+				}
+			}
+			children.push_back(std::move(top));
+		}
+
+		nv_list root;
+		root.add_string(ZPOOL_CONFIG_TYPE, VDEV_TYPE_ROOT);
+		root.add_nvlist_array(ZPOOL_CONFIG_CHILDREN, children.data(), children.size());
+		if (!caches.empty()) root.add_nvlist_array(ZPOOL_CONFIG_L2CACHE, caches.data(), caches.size());
+		if (!spares.empty()) root.add_nvlist_array(ZPOOL_CONFIG_SPARES, spares.data(), spares.size());
+		return root;
+	}
+
+} // namespace zfspp
@@ -0,0 +1,240 @@
+#include "zfspp.h"
+#include <algorithm>
+#include <cstring>
+
+#include <libzfs.h>
+
+namespace zfspp {
+
+	namespace {
+		template<typename T>
+		struct name_entry {
+			const char* name;
+			T value;
+		};
+
+		constexpr bool str_less(const char* a, const char* b) {
+			while (*a != '\0' && *a == *b) {
+				a++;
+				b++;
+			}
+			return static_cast<unsigned char>(*a) < static_cast<unsigned char>(*b);
+		}
+
+		template<typename T, size_t N>
+		constexpr bool is_sorted(const name_entry<T> (&table)[N]) {
+			for (size_t i = 1; i < N; i++) {
+				if (!str_less(table[i - 1].name, table[i].name)) return false;
+			}
+			return true;
+		}
+
+		template<typename T, size_t N>
+		const name_entry<T>* find_name(const name_entry<T> (&table)[N], const char* name) noexcept {
+			auto it = std::lower_bound(std::begin(table), std::end(table), name,
+									   [](const name_entry<T>& e, const char* v) { return strcmp(e.name, v) < 0; });
+			if (it == std::end(table) || strcmp(it->name, name) != 0) return nullptr;
+			return it;
+		}
+
+		constexpr name_entry<zevent_type> ereport_types[] = {
+			{"authentication", zevent_type::ereport_authentication},
+			{"checksum", zevent_type::ereport_checksum},
+			{"config_cache_write", zevent_type::ereport_config_cache_write},
+			{"data", zevent_type::ereport_data},
+			{"deadman", zevent_type::ereport_deadman},
+			{"delay", zevent_type::ereport_delay},
+			{"io", zevent_type::ereport_io},
+			{"io_failure", zevent_type::ereport_io_failure},
+			{"log_replay", zevent_type::ereport_log_replay},
+			{"probe_failure", zevent_type::ereport_probe_failure},
+			{"zpool", zevent_type::ereport_zpool},
+		};
+		static_assert(is_sorted(ereport_types), "ereport_types must be sorted");
+
+		constexpr name_entry<zevent_type> resource_types[] = {
+			{"autoreplace", zevent_type::resource_autoreplace},
+			{"removed", zevent_type::resource_removed},
+			{"statechange", zevent_type::resource_statechange},
+		};
+		static_assert(is_sorted(resource_types), "resource_types must be sorted");
+
+		constexpr name_entry<zevent_type> sysevent_types[] = {
+			{"bootfs_vdev_attach", zevent_type::sysevent_bootfs_vdev_attach},
+			{"config_sync", zevent_type::sysevent_config_sync},
+			{"history_event", zevent_type::sysevent_history_event},
+			{"initialize_cancel", zevent_type::sysevent_initialize_cancel},
+			{"initialize_finish", zevent_type::sysevent_initialize_finish},
+			{"initialize_resume", zevent_type::sysevent_initialize_resume},
+			{"initialize_start", zevent_type::sysevent_initialize_start},
+			{"initialize_suspend", zevent_type::sysevent_initialize_suspend},
+			{"pool_create", zevent_type::sysevent_pool_create},
+			{"pool_destroy", zevent_type::sysevent_pool_destroy},
+			{"pool_export", zevent_type::sysevent_pool_export},
+			{"pool_import", zevent_type::sysevent_pool_import},
+			{"pool_reguid", zevent_type::sysevent_pool_reguid},
+			{"resilver_finish", zevent_type::sysevent_resilver_finish},
+			{"resilver_start", zevent_type::sysevent_resilver_start},
+			{"scrub_abort", zevent_type::sysevent_scrub_abort},
+			{"scrub_finish", zevent_type::sysevent_scrub_finish},
+			{"scrub_paused", zevent_type::sysevent_scrub_paused},
+			{"scrub_resume", zevent_type::sysevent_scrub_resume},
+			{"scrub_start", zevent_type::sysevent_scrub_start},
+			{"trim_cancel", zevent_type::sysevent_trim_cancel},
+			{"trim_finish", zevent_type::sysevent_trim_finish},
+			{"trim_resume", zevent_type::sysevent_trim_resume},
+			{"trim_start", zevent_type::sysevent_trim_start},
+			{"trim_suspend", zevent_type::sysevent_trim_suspend},
+			{"vdev_add", zevent_type::sysevent_vdev_add},
+			{"vdev_attach", zevent_type::sysevent_vdev_attach},
+			{"vdev_autoexpand", zevent_type::sysevent_vdev_autoexpand},
+			{"vdev_check", zevent_type::sysevent_vdev_check},
+			{"vdev_clear", zevent_type::sysevent_vdev_clear},
+			{"vdev_online", zevent_type::sysevent_vdev_online},
+			{"vdev_remove", zevent_type::sysevent_vdev_remove},
+			{"vdev_remove_aux", zevent_type::sysevent_vdev_remove_aux},
+			{"vdev_remove_dev", zevent_type::sysevent_vdev_remove_dev},
+			{"vdev_spare", zevent_type::sysevent_vdev_spare},
+		};
+		static_assert(is_sorted(sysevent_types), "sysevent_types must be sorted");
+
+		enum class field {
+			class_name,
+			eid,
+			history_hostname,
+			history_internal_name,
+			history_internal_str,
+			history_dsname,
+			history_txg,
+			pool,
+			pool_guid,
+			time,
+			vdev_guid,
+			vdev_laststate,
+			vdev_path,
+			vdev_state,
+			zio_blkid,
+			zio_err,
+			zio_level,
+			zio_object,
+			zio_objset,
+			zio_offset,
+			zio_size,
+			count
+		};
+
+		// Ereports name the pool in "pool", sysevents in "pool_name"
+		constexpr name_entry<field> fields[] = {
+			{"class", field::class_name},
+			{"eid", field::eid},
+			{"history_dsname", field::history_dsname},
+			{"history_hostname", field::history_hostname},
+			{"history_internal_name", field::history_internal_name},
+			{"history_internal_str", field::history_internal_str},
+			{"history_txg", field::history_txg},
+			{"pool", field::pool},
+			{"pool_guid", field::pool_guid},
+			{"pool_name", field::pool},
+			{"time", field::time},
+			{"vdev_guid", field::vdev_guid},
+			{"vdev_laststate", field::vdev_laststate},
+			{"vdev_path", field::vdev_path},
+			{"vdev_state", field::vdev_state},
+			{"zio_blkid", field::zio_blkid},
+			{"zio_err", field::zio_err},
+			{"zio_level", field::zio_level},
+			{"zio_object", field::zio_object},
+			{"zio_objset", field::zio_objset},
+			{"zio_offset", field::zio_offset},
+			{"zio_size", field::zio_size},
+		};
+		static_assert(is_sorted(fields), "fields must be sorted");
+
+		zevent_type type_of(const char* cls) noexcept {
+			const name_entry<zevent_type>* res{};
+			if (strncmp(cls, "ereport.fs.zfs.", 15) == 0) {
+				if (strncmp(cls + 15, "vdev.", 5) == 0) return zevent_type::ereport_vdev;
+				res = find_name(ereport_types, cls + 15);
+			} else if (strncmp(cls, "resource.fs.zfs.", 16) == 0) {
+				res = find_name(resource_types, cls + 16);
+			} else if (strncmp(cls, "sysevent.fs.zfs.", 16) == 0) {
+				res = find_name(sysevent_types, cls + 16);
+			}
+			return res == nullptr ? zevent_type::unknown : res->value;
+		}
+
+		std::string_view string_of(nvpair_t* pair) noexcept {
+			char* res{};
+			if (pair == nullptr || nvpair_value_string(pair, &res) != 0) return {};
+			return res;
+		}
+
+		uint64_t uint64_of(nvpair_t* pair) noexcept {
+			uint64_t res{};
+			if (pair != nullptr) nvpair_value_uint64(pair, &res);
+			return res;
+		}
+	} // namespace
+
+	zevent::zevent(const nv_list& event) noexcept {
+		auto raw = event.raw();
+		if (raw == nullptr) return;
+		// Common fields are decoded right away, payload fields once the class is known
+		nvpair_t* payload[static_cast<size_t>(field::count)]{};
+		for (auto pair = nvlist_next_nvpair(raw, nullptr); pair != nullptr; pair = nvlist_next_nvpair(raw, pair)) {
+			auto entry = find_name(fields, nvpair_name(pair));
+			if (entry == nullptr) continue;
+			switch (entry->value) {
+			case field::class_name: class_name = string_of(pair); break;
+			case field::eid: eid = uint64_of(pair); break;
+			case field::pool: pool = string_of(pair); break;
+			case field::pool_guid: pool_guid = uint64_of(pair); break;
+			case field::vdev_guid: vdev_guid = uint64_of(pair); break;
+			case field::vdev_path: vdev_path = string_of(pair); break;
+			case field::time: {
+				int64_t* values{};
+				uint_t count{};
+				if (nvpair_value_int64_array(pair, &values, &count) == 0 && count == 2) time = {values[0], values[1]};
+				break;
+			}
+			default: payload[static_cast<size_t>(entry->value)] = pair;
+			}
+		}
+		// class_name points into the event, so it is terminated
+		if (!class_name.empty()) type = type_of(class_name.data());
+
+		auto get = [&](field f) { return payload[static_cast<size_t>(f)]; };
+		switch (type) {
+		case zevent_type::ereport_authentication:
+		case zevent_type::ereport_checksum:
+		case zevent_type::ereport_data:
+		case zevent_type::ereport_deadman:
+		case zevent_type::ereport_delay:
+		case zevent_type::ereport_io:
+			if (get(field::zio_err) != nullptr) nvpair_value_int32(get(field::zio_err), &zio.err);
+			if (get(field::zio_level) != nullptr) nvpair_value_int64(get(field::zio_level), &zio.level);
+			zio.objset = uint64_of(get(field::zio_objset));
+			zio.object = uint64_of(get(field::zio_object));
+			zio.blkid = uint64_of(get(field::zio_blkid));
+			zio.offset = uint64_of(get(field::zio_offset));
+			zio.size = uint64_of(get(field::zio_size));
+			break;
+		case zevent_type::resource_statechange:
+			state_change = {uint64_of(get(field::vdev_state)), uint64_of(get(field::vdev_laststate))};
+			break;
+		case zevent_type::sysevent_history_event:
+			history = {string_of(get(field::history_hostname)), string_of(get(field::history_dsname)),
+					   string_of(get(field::history_internal_name)), string_of(get(field::history_internal_str)),
+					   uint64_of(get(field::history_txg))};
+			break;
+		default: break;
+		}
+	}
+
+	bool zevent::is_ereport() const noexcept {
+		return class_name.substr(0, 8) == "ereport.";
+	}
+
+	bool zevent::is_sysevent() const noexcept { return class_name.substr(0, 9) == "sysevent."; }
+
+} // namespace zfspp
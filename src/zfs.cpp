@@ -150,6 +150,27 @@ namespace zfspp {
 		return nvl != nullptr;
 	}
 
+	bool zfs::seek_event(uint64_t eid) {
+		std::unique_lock<std::recursive_mutex> lck{m_mutex};
+		if (zpool_events_seek(m_handle, eid, m_eventfd) == 0) return true;
+		if (libzfs_errno(m_handle) == EZFS_NOENT) return false;
+		throw std::system_error(libzfs_errno(m_handle), zfs_category());
+	}
+
+	size_t zfs::drain_events(const std::function<void(const nv_list&)>& cb, size_t* n_dropped) {
+		size_t count = 0;
+		size_t dropped = 0;
+		nv_list data;
+		size_t drop{};
+		while (next_event(data, &drop, false)) {
+			dropped += drop;
+			count++;
+			cb(data);
+		}
+		if (n_dropped) *n_dropped = dropped;
+		return count;
+	}
+
 	bool zfs::validate_dataset_name(const char* name, dataset_type dt, std::string* reason) {
 		std::unique_lock<std::recursive_mutex> lck{m_mutex};
 		bool res = zfs_validate_name(m_handle, name, static_cast<zfs_type_t>(dt), B_FALSE) != B_FALSE;
@@ -1,9 +1,12 @@
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstddef>
 #include <cstdint>
 #include <gtest/gtest.h>
+#include <memory>
 #include <pthread.h>
+#include <string>
 #include <sys/select.h>
 #include <system_error>
 #include <thread>
@@ -16,6 +19,7 @@
 #include <sys/fs/zfs.h>
 #include <sys/nvpair.h>
 #include <unistd.h>
+#include <vector>
 
 TEST(ZFSPP_Test, Dummy) {
 	if (0) {
@@ -74,10 +78,948 @@ TEST(ZFSPP_Test, Dummy) {
         std::cout << pool.features().to_json() << std::endl;
         pool.destroy();
     }
+    if(0) {
+        zfspp::zfs client;
+        zfspp::vdev_topology topology;
+        topology.ashift(12)
+            .mirror({"/home/dominik/Dokumente/zfspp/build/testfs2", "/home/dominik/Dokumente/zfspp/build/testfs3"})
+            .disk("/home/dominik/Dokumente/zfspp/build/testfs4", zfspp::vdev_role::log);
+        auto pool = client.create_pool("testpool2", topology);
+        std::cout << pool.config().to_json() << std::endl;
+        pool.destroy();
+    }
     if(0) {
         zfspp::zfs client;
         std::string reason;
         client.validate_dataset_name("helloworld", zfspp::dataset_type::filesystem, &reason);
         std::cout << reason << std::endl;
     }
-}
\ No newline at end of file
+    if(0) {
+        zfspp::zfs client;
+        zfspp::mount_resolver resolver;
+        std::string name, mountpoint;
+        if(resolver.resolve("/home/dominik/Dokumente", name, &mountpoint))
+            std::cout << name << " mounted at " << mountpoint << std::endl;
+        std::cout << client.open_dataset_from_fs_path("/home", resolver).name() << std::endl;
+    }
+}
+
+namespace {
+	zfspp::nv_list make_event(const char* cls, uint64_t eid, uint64_t pool_guid = 0, uint64_t vdev_guid = 0) {
+		zfspp::nv_list res;
+		res.add_string("class", cls);
+		res.add_uint64("eid", eid);
+		if (pool_guid != 0) res.add_uint64("pool_guid", pool_guid);
+		if (vdev_guid != 0) res.add_uint64("vdev_guid", vdev_guid);
+		return res;
+	}
+
+	uint64_t eid_of(const zfspp::nv_list& event) {
+		uint64_t res{};
+		nvlist_lookup_uint64(event.raw(), "eid", &res);
+		return res;
+	}
+
+	std::vector<uint64_t> drain(zfspp::event_queue& q) {
+		std::vector<uint64_t> res;
+		zfspp::nv_list value;
+		while (q.pop(value))
+			res.push_back(eid_of(value));
+		return res;
+	}
+
+	constexpr std::chrono::milliseconds queue_timeout{10};
+	constexpr const char* statechange = "resource.fs.zfs.statechange";
+	constexpr const char* checksum = "ereport.fs.zfs.checksum";
+} // namespace
+
+TEST(ZFSPP_Test, EventQueueCapacity) {
+	EXPECT_EQ(zfspp::event_queue(0).capacity(), 2);
+	EXPECT_EQ(zfspp::event_queue(1).capacity(), 2);
+	EXPECT_EQ(zfspp::event_queue(3).capacity(), 4);
+	EXPECT_EQ(zfspp::event_queue(1024).capacity(), 1024);
+}
+
+TEST(ZFSPP_Test, EventQueueBlockIsFifo) {
+	zfspp::event_queue q(4);
+	EXPECT_TRUE(q.empty());
+	for (uint64_t i = 1; i <= 4; i++) {
+		auto event = make_event(statechange, i, 1, 1);
+		EXPECT_EQ(q.push(event, zfspp::overflow_policy::block, queue_timeout), 0);
+	}
+	EXPECT_TRUE(q.full());
+	EXPECT_EQ(drain(q), (std::vector<uint64_t>{1, 2, 3, 4}));
+	EXPECT_TRUE(q.empty());
+}
+
+TEST(ZFSPP_Test, EventQueueDropOldest) {
+	zfspp::event_queue q(2);
+	size_t dropped = 0;
+	for (uint64_t i = 1; i <= 5; i++) {
+		auto event = make_event(checksum, i);
+		dropped += q.push(event, zfspp::overflow_policy::drop_oldest, queue_timeout);
+	}
+	EXPECT_EQ(dropped, 3);
+	EXPECT_EQ(drain(q), (std::vector<uint64_t>{4, 5}));
+}
+
+TEST(ZFSPP_Test, EventQueueCoalesce) {
+	zfspp::event_queue q(2);
+	auto push = [&](const char* cls, uint64_t eid, uint64_t vdev) {
+		auto event = make_event(cls, eid, 7, vdev);
+		return q.push(event, zfspp::overflow_policy::coalesce, queue_timeout);
+	};
+	EXPECT_EQ(push(statechange, 1, 1), 0);
+	EXPECT_EQ(push(statechange, 2, 1), 0);
+	EXPECT_EQ(q.held(), 0);
+	// The ring is full, so state events are held back and a newer one replaces the older of the same vdev
+	EXPECT_EQ(push(statechange, 3, 1), 0);
+	EXPECT_EQ(push(statechange, 4, 2), 0);
+	EXPECT_EQ(push(statechange, 5, 1), 1);
+	EXPECT_EQ(q.held(), 2);
+
+	// The replacement moved behind the event of the other vdev
+	std::vector<uint64_t> order;
+	zfspp::nv_list value;
+	while (q.pop(value)) {
+		order.push_back(eid_of(value));
+		q.flush_held();
+	}
+	EXPECT_EQ(order, (std::vector<uint64_t>{1, 2, 4, 5}));
+	EXPECT_EQ(q.held(), 0);
+}
+
+TEST(ZFSPP_Test, EventQueueCoalesceKeepsRecords) {
+	EXPECT_TRUE(zfspp::event_queue::is_coalescible(make_event(statechange, 1)));
+	EXPECT_FALSE(zfspp::event_queue::is_coalescible(make_event(checksum, 1)));
+	EXPECT_FALSE(zfspp::event_queue::is_coalescible(make_event("sysevent.fs.zfs.history_event", 1)));
+	EXPECT_FALSE(zfspp::event_queue::is_coalescible(zfspp::nv_list{}));
+
+	// Ereports wait for room instead of being held, so every one of them arrives in order
+	zfspp::event_queue q(2);
+	std::vector<uint64_t> received;
+	std::thread consumer([&]() {
+		zfspp::nv_list value;
+		while (received.size() < 6) {
+			if (q.pop(value))
+				received.push_back(eid_of(value));
+			else
+				q.wait_data_until(std::chrono::steady_clock::now() + queue_timeout);
+		}
+	});
+	size_t replaced = 0;
+	for (uint64_t i = 1; i <= 6; i++) {
+		auto event = make_event(i % 2 == 0 ? statechange : checksum, i, 7, 1);
+		replaced += q.push(event, zfspp::overflow_policy::coalesce, queue_timeout);
+	}
+	while (q.held() != 0) {
+		q.wait_space(queue_timeout, nullptr);
+		q.flush_held();
+	}
+	consumer.join();
+	EXPECT_EQ(replaced, 0);
+	EXPECT_EQ(received, (std::vector<uint64_t>{1, 2, 3, 4, 5, 6}));
+}
+
+TEST(ZFSPP_Test, EventQueueMultiProducerMultiConsumer) {
+	constexpr size_t producers = 4;
+	constexpr size_t consumers = 4;
+	constexpr uint64_t per_producer = 5000;
+	zfspp::event_queue q(64);
+	std::vector<std::vector<uint64_t>> received(consumers);
+	std::vector<std::thread> threads;
+	for (size_t c = 0; c < consumers; c++) {
+		threads.emplace_back([&q, &out = received[c]]() {
+			zfspp::nv_list value;
+			while (true) {
+				if (q.pop(value))
+					out.push_back(eid_of(value));
+				else if (!q.wait_data())
+					break;
+			}
+		});
+	}
+	std::vector<std::thread> writers;
+	for (size_t p = 0; p < producers; p++) {
+		writers.emplace_back([&q, p]() {
+			for (uint64_t i = 0; i < per_producer; i++) {
+				auto event = make_event(checksum, p * per_producer + i);
+				q.push(event, zfspp::overflow_policy::block, queue_timeout);
+			}
+		});
+	}
+	for (auto& t : writers)
+		t.join();
+	q.close();
+	for (auto& t : threads)
+		t.join();
+
+	std::vector<uint64_t> all;
+	for (auto& r : received) {
+		// Every consumer takes positions in ring order, so each producer's events stay ordered per consumer
+		std::vector<uint64_t> last(producers, 0);
+		std::vector<bool> any(producers, false);
+		for (auto eid : r) {
+			auto p = eid / per_producer;
+			EXPECT_TRUE(!any[p] || last[p] < eid);
+			any[p] = true;
+			last[p] = eid;
+		}
+		all.insert(all.end(), r.begin(), r.end());
+	}
+	std::sort(all.begin(), all.end());
+	ASSERT_EQ(all.size(), producers * per_producer);
+	for (uint64_t i = 0; i < all.size(); i++)
+		ASSERT_EQ(all[i], i);
+}
+
+TEST(ZFSPP_Test, EventFilterClasses) {
+	zfspp::event_filter filter;
+	EXPECT_TRUE(filter.empty());
+	EXPECT_TRUE(filter.matches(make_event(checksum, 1).raw()));
+	EXPECT_FALSE(filter.matches(nullptr));
+
+	filter.add_class("ereport.fs.zfs.*").add_class("sysevent.fs.zfs.pool_create");
+	EXPECT_FALSE(filter.empty());
+	EXPECT_TRUE(filter.matches(make_event(checksum, 1).raw()));
+	EXPECT_TRUE(filter.matches(make_event("ereport.fs.zfs.vdev.open_failed", 1).raw()));
+	EXPECT_TRUE(filter.matches(make_event("ereport.fs.zfs.", 1).raw()));
+	EXPECT_FALSE(filter.matches(make_event("ereport.fs.zf", 1).raw()));
+	EXPECT_TRUE(filter.matches(make_event("sysevent.fs.zfs.pool_create", 1).raw()));
+	// Names without a trailing '*' only match exactly
+	EXPECT_FALSE(filter.matches(make_event("sysevent.fs.zfs.pool_creat", 1).raw()));
+	EXPECT_FALSE(filter.matches(make_event("sysevent.fs.zfs.pool_create_x", 1).raw()));
+	EXPECT_FALSE(filter.matches(make_event(statechange, 1).raw()));
+
+	zfspp::nv_list no_class;
+	no_class.add_uint64("eid", 1);
+	EXPECT_FALSE(filter.matches(no_class.raw()));
+
+	zfspp::event_filter all;
+	all.add_class("*");
+	EXPECT_TRUE(all.matches(make_event(statechange, 1).raw()));
+	EXPECT_FALSE(all.matches(no_class.raw()));
+}
+
+TEST(ZFSPP_Test, EventFilterPools) {
+	zfspp::event_filter filter;
+	filter.add_pool(42).add_pool("tank");
+	EXPECT_TRUE(filter.matches(make_event(checksum, 1, 42).raw()));
+	EXPECT_FALSE(filter.matches(make_event(checksum, 1, 7).raw()));
+	EXPECT_FALSE(filter.matches(make_event(checksum, 1).raw()));
+
+	// Ereports name the pool in "pool", sysevents in "pool_name"
+	auto ereport = make_event(checksum, 1, 7);
+	ereport.add_string("pool", "tank");
+	EXPECT_TRUE(filter.matches(ereport.raw()));
+	auto sysevent = make_event("sysevent.fs.zfs.scrub_start", 2, 7);
+	sysevent.add_string("pool_name", "tank");
+	EXPECT_TRUE(filter.matches(sysevent.raw()));
+	sysevent.add_string("pool_name", "tank2");
+	EXPECT_FALSE(filter.matches(sysevent.raw()));
+}
+
+TEST(ZFSPP_Test, EventFilterCombined) {
+	zfspp::event_filter filter;
+	filter.add_class(statechange).add_pool("tank").add_vdev(9);
+	auto event = make_event(statechange, 1, 7, 9);
+	event.add_string("pool", "tank");
+	EXPECT_TRUE(filter.matches(event.raw()));
+
+	// Every configured criterion has to match
+	event.add_uint64("vdev_guid", 8);
+	EXPECT_FALSE(filter.matches(event.raw()));
+	auto other_class = make_event(checksum, 1, 7, 9);
+	other_class.add_string("pool", "tank");
+	EXPECT_FALSE(filter.matches(other_class.raw()));
+	EXPECT_FALSE(filter.matches(make_event(statechange, 1, 7, 9).raw()));
+}
+
+TEST(ZFSPP_Test, ZeventDecodesIoEreport) {
+	auto event = make_event(checksum, 17, 42, 9);
+	int64_t time[2] = {1700000000, 123456789};
+	event.add_int64_array("time", time, 2);
+	event.add_string("pool", "tank");
+	event.add_string("vdev_path", "/dev/sda1");
+	event.add_int32("zio_err", 52);
+	event.add_int64("zio_level", -1);
+	event.add_uint64("zio_objset", 54);
+	event.add_uint64("zio_object", 3);
+	event.add_uint64("zio_blkid", 12);
+	event.add_uint64("zio_offset", 4096);
+	event.add_uint64("zio_size", 512);
+
+	zfspp::zevent decoded{event};
+	EXPECT_EQ(decoded.type, zfspp::zevent_type::ereport_checksum);
+	EXPECT_TRUE(decoded.is_ereport());
+	EXPECT_FALSE(decoded.is_sysevent());
+	EXPECT_EQ(decoded.class_name, checksum);
+	EXPECT_EQ(decoded.eid, 17);
+	EXPECT_EQ(decoded.pool, "tank");
+	EXPECT_EQ(decoded.pool_guid, 42);
+	EXPECT_EQ(decoded.vdev_guid, 9);
+	EXPECT_EQ(decoded.vdev_path, "/dev/sda1");
+	EXPECT_EQ(decoded.time[0], 1700000000);
+	EXPECT_EQ(decoded.time[1], 123456789);
+	EXPECT_EQ(decoded.zio.err, 52);
+	EXPECT_EQ(decoded.zio.level, -1);
+	EXPECT_EQ(decoded.zio.objset, 54);
+	EXPECT_EQ(decoded.zio.object, 3);
+	EXPECT_EQ(decoded.zio.blkid, 12);
+	EXPECT_EQ(decoded.zio.offset, 4096);
+	EXPECT_EQ(decoded.zio.size, 512);
+}
+
+TEST(ZFSPP_Test, ZeventDecodesStateChange) {
+	auto event = make_event(statechange, 3, 42, 9);
+	event.add_uint64("vdev_state", 5);
+	event.add_uint64("vdev_laststate", 7);
+	// A time array of the wrong length is ignored
+	int64_t time[1] = {1700000000};
+	event.add_int64_array("time", time, 1);
+
+	zfspp::zevent decoded{event};
+	EXPECT_EQ(decoded.type, zfspp::zevent_type::resource_statechange);
+	EXPECT_FALSE(decoded.is_ereport());
+	EXPECT_EQ(decoded.state_change.state, 5);
+	EXPECT_EQ(decoded.state_change.last_state, 7);
+	EXPECT_EQ(decoded.time[0], 0);
+	EXPECT_EQ(decoded.time[1], 0);
+}
+
+TEST(ZFSPP_Test, ZeventDecodesHistory) {
+	auto event = make_event("sysevent.fs.zfs.history_event", 5, 42);
+	event.add_string("pool_name", "tank");
+	event.add_string("history_hostname", "host");
+	event.add_string("history_dsname", "tank/home");
+	event.add_string("history_internal_name", "snapshot");
+	event.add_string("history_internal_str", "tank/home@now");
+	event.add_uint64("history_txg", 1234);
+
+	zfspp::zevent decoded{event};
+	EXPECT_EQ(decoded.type, zfspp::zevent_type::sysevent_history_event);
+	EXPECT_TRUE(decoded.is_sysevent());
+	EXPECT_EQ(decoded.pool, "tank");
+	EXPECT_EQ(decoded.history.hostname, "host");
+	EXPECT_EQ(decoded.history.dsname, "tank/home");
+	EXPECT_EQ(decoded.history.internal_name, "snapshot");
+	EXPECT_EQ(decoded.history.internal_str, "tank/home@now");
+	EXPECT_EQ(decoded.history.txg, 1234);
+}
+
+TEST(ZFSPP_Test, ZeventTypes) {
+	auto type_of = [](const char* cls) { return zfspp::zevent(make_event(cls, 1)).type; };
+	EXPECT_EQ(type_of("ereport.fs.zfs.io"), zfspp::zevent_type::ereport_io);
+	EXPECT_EQ(type_of("ereport.fs.zfs.vdev.open_failed"), zfspp::zevent_type::ereport_vdev);
+	EXPECT_EQ(type_of("resource.fs.zfs.removed"), zfspp::zevent_type::resource_removed);
+	EXPECT_EQ(type_of("sysevent.fs.zfs.vdev_remove_aux"), zfspp::zevent_type::sysevent_vdev_remove_aux);
+	EXPECT_EQ(type_of("sysevent.fs.zfs.scrub_start"), zfspp::zevent_type::sysevent_scrub_start);
+	EXPECT_EQ(type_of("sysevent.fs.zfs.unknown_event"), zfspp::zevent_type::unknown);
+	EXPECT_EQ(type_of("ereport.fs.zfs.i"), zfspp::zevent_type::unknown);
+	EXPECT_EQ(type_of("misc.fs.zfs.io"), zfspp::zevent_type::unknown);
+
+	// Payload fields of other types are not decoded
+	auto event = make_event("ereport.fs.zfs.probe_failure", 1);
+	event.add_int32("zio_err", 5);
+	zfspp::zevent decoded{event};
+	EXPECT_EQ(decoded.type, zfspp::zevent_type::ereport_probe_failure);
+	EXPECT_EQ(decoded.zio.err, 0);
+
+	zfspp::zevent empty{zfspp::nv_list{}};
+	EXPECT_EQ(empty.type, zfspp::zevent_type::unknown);
+	EXPECT_TRUE(empty.class_name.empty());
+}
+
+TEST(ZFSPP_Test, RetentionKeepLastAndPrefix) {
+	std::vector<zfspp::snapshot_info> snapshots{
+		{"tank/b@auto-1", 100, 0, {}}, {"tank/a@auto-3", 300, 0, {}}, {"tank/a@auto-1", 100, 0, {}},
+		{"tank/a@manual", 50, 0, {}},  {"tank/a@auto-4", 400, 0, {}}, {"tank/a@auto-2", 200, 0, {}},
+		{"tank/b@auto-2", 200, 0, {}}, {"tank/b@auto-3", 300, 0, {}}, {"tank/a@auto-5", 500, 0, {}},
+	};
+	zfspp::retention_policy policy;
+	policy.prefix = "auto-";
+	policy.keep_last = 2;
+
+	// keep_last applies per dataset and snapshots without the prefix are never touched
+	auto plan = zfspp::plan_retention(policy, snapshots);
+	EXPECT_EQ(plan.destroy,
+			  (std::vector<std::string>{"tank/a@auto-1", "tank/a@auto-2", "tank/a@auto-3", "tank/b@auto-1"}));
+	EXPECT_EQ(plan.kept, 5);
+	EXPECT_EQ(plan.compact(), "tank/a@auto-1,auto-2,auto-3\ntank/b@auto-1\n");
+}
+
+TEST(ZFSPP_Test, RetentionBuckets) {
+	// 2023-11-14 21:00 UTC, a tuesday
+	constexpr uint64_t hour = 1699995600;
+	std::vector<zfspp::snapshot_info> snapshots;
+	for (uint64_t i = 0; i < 9; i++)
+		snapshots.push_back({"tank@s" + std::to_string(i), hour + i * 1200, 0, {}});
+	zfspp::retention_policy policy;
+	policy.hourly = 2;
+
+	// The newest snapshot of each of the two newest hours is kept
+	auto plan = zfspp::plan_retention(policy, snapshots);
+	EXPECT_EQ(plan.destroy,
+			  (std::vector<std::string>{"tank@s0", "tank@s1", "tank@s2", "tank@s3", "tank@s4", "tank@s6", "tank@s7"}));
+	EXPECT_EQ(plan.kept, 2);
+
+	// 23:30 and 00:30 UTC are the same day one hour east of UTC
+	constexpr uint64_t midnight = 1699920000;
+	std::vector<zfspp::snapshot_info> days{{"tank@a", midnight - 1800, 0, {}}, {"tank@b", midnight + 1800, 0, {}}};
+	zfspp::retention_policy daily;
+	daily.daily = 2;
+	EXPECT_TRUE(zfspp::plan_retention(daily, days).destroy.empty());
+	daily.utc_offset = std::chrono::hours(1);
+	EXPECT_EQ(zfspp::plan_retention(daily, days).destroy, (std::vector<std::string>{"tank@a"}));
+
+	// Weeks start on monday, so sunday and monday noon are in different weeks but monday and tuesday are not
+	constexpr uint64_t monday = 1699833600;
+	std::vector<zfspp::snapshot_info> weeks{{"tank@sun", monday - 43200, 0, {}},
+											{"tank@mon", monday + 43200, 0, {}},
+											{"tank@tue", monday + 86400 + 43200, 0, {}}};
+	zfspp::retention_policy weekly;
+	weekly.weekly = 2;
+	EXPECT_EQ(zfspp::plan_retention(weekly, weeks).destroy, (std::vector<std::string>{"tank@mon"}));
+}
+
+TEST(ZFSPP_Test, RetentionHolds) {
+	std::vector<zfspp::snapshot_info> snapshots{
+		{"tank@held", 100, 1, {}},
+		{"tank@backup", 200, 2, {"other", "backup"}},
+		{"tank@other", 300, 1, {"other"}},
+		{"tank@free", 400, 0, {}},
+	};
+	zfspp::retention_policy policy;
+	auto plan = zfspp::plan_retention(policy, snapshots);
+	EXPECT_EQ(plan.destroy, (std::vector<std::string>{"tank@free"}));
+	EXPECT_EQ(plan.kept, 3);
+
+	// Without keep_held only the listed tags protect a snapshot
+	policy.keep_held = false;
+	policy.hold_tags = {"backup"};
+	plan = zfspp::plan_retention(policy, snapshots);
+	EXPECT_EQ(plan.destroy, (std::vector<std::string>{"tank@held", "tank@other", "tank@free"}));
+	EXPECT_EQ(plan.kept, 1);
+}
+
+// Runs against a pool on a sparse file, skipped without access to /dev/zfs
+class ZFSPP_Pool : public ::testing::Test {
+protected:
+	std::unique_ptr<zfspp::zfs> client;
+	std::string name;
+	std::string file;
+
+	void SetUp() override {
+		if (access("/dev/zfs", R_OK | W_OK) != 0) GTEST_SKIP() << "no access to /dev/zfs";
+		name = "zfspp_test_" + std::to_string(getpid());
+		file = "/var/tmp/" + name + ".img";
+		int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(ftruncate(fd, 256 << 20), 0);
+		close(fd);
+		client.reset(new zfspp::zfs());
+		zfspp::vdev_topology topology;
+		topology.disk(file);
+		zfspp::nv_list fs_options;
+		fs_options.add_string("mountpoint", "none");
+		client->create_pool(name, topology, {}, fs_options);
+	}
+
+	void TearDown() override {
+		if (client) {
+			try {
+				client->open_pool(name).destroy(true);
+			} catch (const std::system_error&) {}
+		}
+		if (!file.empty()) unlink(file.c_str());
+	}
+};
+
+TEST_F(ZFSPP_Pool, HoldAndReleaseReportMissingSnapshots) {
+	client->open_dataset(name).create_snapshot("a");
+	auto existing = name + "@a";
+	auto missing = name + "@missing";
+
+	// The kernel holds what exists and only lists the rest, the call itself succeeds
+	auto errors = client->hold({existing, missing}, "zfspp");
+	ASSERT_EQ(errors.size(), 1);
+	EXPECT_EQ(errors.at(missing), std::error_code(ENOENT, std::system_category()));
+	auto holds = client->holds({existing, missing});
+	EXPECT_EQ(holds.at(existing).count("zfspp"), 1);
+	EXPECT_EQ(holds.count(missing), 0);
+
+	errors = client->release({existing, missing}, "zfspp");
+	ASSERT_EQ(errors.size(), 1);
+	EXPECT_EQ(errors.count(missing), 1);
+	EXPECT_TRUE(client->holds({existing}).at(existing).empty());
+}
+
+namespace {
+	// Cache whose misses return invalid handles and are recorded, so it works without a pool
+	struct counting_cache {
+		std::vector<std::string> opened;
+		zfspp::dataset_cache cache;
+
+		explicit counting_cache(size_t capacity)
+			: cache(
+				  [this](const std::string& name, zfspp::dataset_type) {
+					  opened.push_back(name);
+					  return zfspp::dataset{};
+				  },
+				  capacity) {}
+
+		// Returns true on a hit
+		bool open(const std::string& name) {
+			auto misses = opened.size();
+			cache.open(name);
+			return opened.size() == misses;
+		}
+	};
+
+	zfspp::nv_list history_event(const char* dsname, const char* operation) {
+		zfspp::nv_list res;
+		res.add_string("class", "sysevent.fs.zfs.history_event");
+		res.add_string("history_dsname", dsname);
+		res.add_string("history_internal_name", operation);
+		return res;
+	}
+} // namespace
+
+TEST(ZFSPP_Test, DatasetCacheLru) {
+	counting_cache c(2);
+	EXPECT_FALSE(c.open("tank/a"));
+	EXPECT_FALSE(c.open("tank/b"));
+	EXPECT_TRUE(c.open("tank/a"));
+	// tank/b is the least recently used entry now
+	EXPECT_FALSE(c.open("tank/c"));
+	EXPECT_TRUE(c.open("tank/a"));
+	EXPECT_FALSE(c.open("tank/b"));
+
+	auto stats = c.cache.stats();
+	EXPECT_EQ(stats.hits, 2);
+	EXPECT_EQ(stats.misses, 4);
+	EXPECT_EQ(stats.evictions, 2);
+	EXPECT_EQ(stats.size, 2);
+	EXPECT_EQ(stats.capacity, 2);
+
+	c.cache.set_capacity(1);
+	EXPECT_EQ(c.cache.stats().size, 1);
+	EXPECT_TRUE(c.open("tank/b"));
+	c.cache.clear();
+	EXPECT_EQ(c.cache.stats().size, 0);
+	EXPECT_FALSE(c.open("tank/b"));
+}
+
+TEST(ZFSPP_Test, DatasetCacheHistoryEvents) {
+	counting_cache c(16);
+	for (auto name : {"tank", "tank/a", "tank/a/b", "tank/a@s", "tank/ab", "tank/x", "tank/x/child", "tank/x@new"})
+		c.open(name);
+
+	// A rename drops the dataset with its children and snapshots, but not tank/ab
+	c.cache.handle_event(history_event("tank/a", "rename"));
+	EXPECT_FALSE(c.open("tank/a"));
+	EXPECT_FALSE(c.open("tank/a/b"));
+	EXPECT_FALSE(c.open("tank/a@s"));
+	EXPECT_TRUE(c.open("tank/ab"));
+
+	// A snapshot is logged on the snapshot but changes the parent, its children stay
+	c.cache.handle_event(history_event("tank/x@new", "snapshot"));
+	EXPECT_FALSE(c.open("tank/x@new"));
+	EXPECT_FALSE(c.open("tank/x"));
+	EXPECT_TRUE(c.open("tank/x/child"));
+
+	// Operations which change nothing cached and other classes are ignored
+	c.cache.handle_event(history_event("tank/ab", "hold"));
+	c.cache.handle_event(make_event(checksum, 1));
+	EXPECT_TRUE(c.open("tank/ab"));
+
+	zfspp::nv_list destroyed;
+	destroyed.add_string("class", "sysevent.fs.zfs.pool_destroy");
+	destroyed.add_string("pool_name", "tank");
+	c.cache.handle_event(destroyed);
+	EXPECT_EQ(c.cache.stats().size, 0);
+}
+
+TEST(ZFSPP_Test, DatasetCacheInvalidationDuringOpen) {
+	zfspp::dataset_cache* self{};
+	size_t opens = 0;
+	zfspp::dataset_cache cache(
+		[&](const std::string& name, zfspp::dataset_type) {
+			// An event for the dataset arrives while it is being opened
+			if (opens++ == 0) self->invalidate(name);
+			return zfspp::dataset{};
+		},
+		4);
+	self = &cache;
+	cache.open("tank/a");
+	EXPECT_EQ(cache.stats().size, 0);
+	cache.open("tank/a");
+	EXPECT_EQ(cache.stats().size, 1);
+	cache.open("tank/a");
+	EXPECT_EQ(opens, 2);
+}
+
+TEST(ZFSPP_Test, MountResolverOctalEscapes) {
+	zfspp::mount_resolver resolver{"25 1 0:22 / /mnt/my\\040data\\134x rw shared:1 - zfs tank/my\\040data rw,xattr\n"};
+	EXPECT_EQ(resolver.fd(), -1);
+	std::string name, mountpoint;
+	ASSERT_TRUE(resolver.resolve("/mnt/my data\\x/file", name, &mountpoint));
+	EXPECT_EQ(name, "tank/my data");
+	EXPECT_EQ(mountpoint, "/mnt/my data\\x");
+	EXPECT_FALSE(resolver.resolve("/mnt/my\\040data\\134x", name));
+	EXPECT_THROW(resolver.refresh(), std::logic_error);
+	EXPECT_FALSE(resolver.refresh_if_changed());
+}
+
+TEST(ZFSPP_Test, MountResolverOptionalFields) {
+	zfspp::mount_resolver resolver{"20 1 0:20 / / rw - zfs rpool/ROOT rw\n"
+								   "21 20 0:21 / /home rw shared:2 master:1 propagate_from:1 - zfs rpool/home rw\n"
+								   "22 20 0:22 / /broken rw shared:3\n"
+								   "23 20 0:23 / /var rw,relatime shared:4 - zfs rpool/var rw"};
+	EXPECT_EQ(resolver.size(), 3);
+	std::string name, mountpoint;
+	ASSERT_TRUE(resolver.resolve("/etc/passwd", name, &mountpoint));
+	EXPECT_EQ(name, "rpool/ROOT");
+	EXPECT_EQ(mountpoint, "/");
+	ASSERT_TRUE(resolver.resolve("/home/user", name, &mountpoint));
+	EXPECT_EQ(name, "rpool/home");
+	EXPECT_EQ(mountpoint, "/home");
+	ASSERT_TRUE(resolver.resolve("/var", name, &mountpoint));
+	EXPECT_EQ(name, "rpool/var");
+	EXPECT_EQ(mountpoint, "/var");
+	// A line without the separator is skipped, the path belongs to the root dataset
+	ASSERT_TRUE(resolver.resolve("/broken/file", name, &mountpoint));
+	EXPECT_EQ(name, "rpool/ROOT");
+	EXPECT_FALSE(resolver.resolve("relative/path", name));
+}
+
+TEST(ZFSPP_Test, MountResolverStackedMounts) {
+	zfspp::mount_resolver resolver{"30 1 0:30 / /data rw - zfs tank/old rw\n"
+								   "31 1 0:31 / /data rw - zfs tank/new rw\n"};
+	EXPECT_EQ(resolver.size(), 1);
+	std::string name;
+	ASSERT_TRUE(resolver.resolve("/data/file", name));
+	EXPECT_EQ(name, "tank/new");
+	// Unmounting the top of the stack uncovers the one below
+	resolver.update("30 1 0:30 / /data rw - zfs tank/old rw\n");
+	ASSERT_TRUE(resolver.resolve("/data/file", name));
+	EXPECT_EQ(name, "tank/old");
+}
+
+TEST(ZFSPP_Test, MountResolverPruneOnUnmount) {
+	zfspp::mount_resolver resolver{"40 1 0:40 / /tank rw - zfs tank rw\n"
+								   "41 40 0:41 / /tank/a/b/c rw - zfs tank/c rw\n"
+								   "42 40 0:42 / /tank/a/d rw - zfs tank/d rw\n"};
+	std::string name, mountpoint;
+	ASSERT_TRUE(resolver.resolve("/tank/a/b/c/file", name, &mountpoint));
+	EXPECT_EQ(name, "tank/c");
+
+	resolver.update("40 1 0:40 / /tank rw - zfs tank rw\n"
+					"42 40 0:42 / /tank/a/d rw - zfs tank/d rw\n");
+	EXPECT_EQ(resolver.size(), 2);
+	ASSERT_TRUE(resolver.resolve("/tank/a/b/c/file", name, &mountpoint));
+	EXPECT_EQ(name, "tank");
+	EXPECT_EQ(mountpoint, "/tank");
+	// Pruning stops at the shared prefix of the remaining mount
+	ASSERT_TRUE(resolver.resolve("/tank/a/d/file", name, &mountpoint));
+	EXPECT_EQ(name, "tank/d");
+	EXPECT_EQ(mountpoint, "/tank/a/d");
+
+	resolver.update("");
+	EXPECT_EQ(resolver.size(), 0);
+	EXPECT_FALSE(resolver.resolve("/tank/a/d/file", name));
+	resolver.update("42 1 0:42 / /tank/a/d rw - zfs tank/d rw\n");
+	ASSERT_TRUE(resolver.resolve("/tank/a/d/file", name));
+	EXPECT_EQ(name, "tank/d");
+	EXPECT_FALSE(resolver.resolve("/tank/a/file", name));
+}
+
+TEST(ZFSPP_Test, MountResolverForeignMountHidesDataset) {
+	zfspp::mount_resolver resolver{"50 1 0:50 / /tank rw - zfs tank rw\n"
+								   "51 50 0:51 / /tank/tmp rw,nosuid - tmpfs tmpfs rw,size=1024k\n"};
+	std::string name, mountpoint;
+	EXPECT_FALSE(resolver.resolve("/tank/tmp/file", name));
+	EXPECT_FALSE(resolver.resolve("/tank/tmp", name));
+	ASSERT_TRUE(resolver.resolve("/tank/tmpfile", name, &mountpoint));
+	EXPECT_EQ(name, "tank");
+	EXPECT_EQ(mountpoint, "/tank");
+}
+
+// Empty files in /var/tmp as devices, vdev_topology only checks that they exist
+class ZFSPP_Topology : public ::testing::Test {
+protected:
+	std::vector<std::string> files;
+
+	void SetUp() override {
+		for (size_t i = 0; i < 12; i++) {
+			files.push_back("/var/tmp/zfspp_topology_" + std::to_string(getpid()) + "_" + std::to_string(i));
+			int fd = open(files.back().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			ASSERT_GE(fd, 0);
+			close(fd);
+		}
+	}
+
+	void TearDown() override {
+		for (auto& e : files)
+			unlink(e.c_str());
+	}
+
+	std::vector<std::string> devices(size_t first, size_t count) const {
+		return {files.begin() + first, files.begin() + first + count};
+	}
+};
+
+TEST_F(ZFSPP_Topology, MirrorAndRaidz) {
+	zfspp::vdev_topology topology;
+	EXPECT_TRUE(topology.empty());
+	topology.ashift(12).mirror(devices(0, 2)).raidz(2, devices(2, 4)).ashift(0);
+	topology.mirror(devices(6, 2), zfspp::vdev_role::log).disk(files[8], zfspp::vdev_role::special);
+	topology.cache({files[9]}).spare({files[10]});
+	EXPECT_FALSE(topology.empty());
+
+	auto root = topology.build();
+	EXPECT_EQ(root.at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_ROOT);
+	auto children = root.at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(children.size(), 4);
+
+	EXPECT_EQ(children[0].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_MIRROR);
+	EXPECT_EQ(children[0].at(ZPOOL_CONFIG_IS_LOG).as_uint64(), 0);
+	EXPECT_EQ(children[0].find(ZPOOL_CONFIG_NPARITY), children[0].end());
+	auto leaves = children[0].at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(leaves.size(), 2);
+	for (size_t i = 0; i < leaves.size(); i++) {
+		EXPECT_EQ(leaves[i].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_FILE);
+		EXPECT_EQ(leaves[i].at(ZPOOL_CONFIG_PATH).as_string(), files[i]);
+		EXPECT_EQ(leaves[i].at(ZPOOL_CONFIG_ASHIFT).as_uint64(), 12);
+	}
+
+	EXPECT_EQ(children[1].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_RAIDZ);
+	EXPECT_EQ(children[1].at(ZPOOL_CONFIG_NPARITY).as_uint64(), 2);
+	leaves = children[1].at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(leaves.size(), 4);
+	EXPECT_EQ(leaves[3].at(ZPOOL_CONFIG_PATH).as_string(), files[5]);
+
+	EXPECT_EQ(children[2].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_MIRROR);
+	EXPECT_EQ(children[2].at(ZPOOL_CONFIG_IS_LOG).as_uint64(), 1);
+	leaves = children[2].at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(leaves.size(), 2);
+	EXPECT_EQ(leaves[0].find(ZPOOL_CONFIG_ASHIFT), leaves[0].end());
+
+	// A single disk is a leaf on the top level
+	EXPECT_EQ(children[3].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_FILE);
+	EXPECT_EQ(children[3].at(ZPOOL_CONFIG_PATH).as_string(), files[8]);
+	EXPECT_EQ(children[3].at(ZPOOL_CONFIG_ALLOCATION_BIAS).as_string(), VDEV_ALLOC_BIAS_SPECIAL);
+	EXPECT_EQ(children[3].find(ZPOOL_CONFIG_CHILDREN), children[3].end());
+
+	auto caches = root.at(ZPOOL_CONFIG_L2CACHE).as_nvlist_array();
+	ASSERT_EQ(caches.size(), 1);
+	EXPECT_EQ(caches[0].at(ZPOOL_CONFIG_PATH).as_string(), files[9]);
+	auto spares = root.at(ZPOOL_CONFIG_SPARES).as_nvlist_array();
+	ASSERT_EQ(spares.size(), 1);
+	EXPECT_EQ(spares[0].at(ZPOOL_CONFIG_PATH).as_string(), files[10]);
+}
+
+TEST_F(ZFSPP_Topology, Draid) {
+	zfspp::vdev_topology topology;
+	topology.disk(files[0], zfspp::vdev_role::dedup).spare({files[1]}).draid(2, devices(2, 10), 3, 2);
+	auto root = topology.build();
+	auto children = root.at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(children.size(), 2);
+	EXPECT_EQ(children[0].at(ZPOOL_CONFIG_ALLOCATION_BIAS).as_string(), VDEV_ALLOC_BIAS_DEDUP);
+
+	auto& draid = children[1];
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_DRAID);
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_NPARITY).as_uint64(), 2);
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_DRAID_NDATA).as_uint64(), 3);
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_DRAID_NSPARES).as_uint64(), 2);
+	// Groups of 5 devices have to fill rows of the 8 devices left after the spares
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_DRAID_NGROUPS).as_uint64(), 8);
+	EXPECT_EQ(draid.at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array().size(), 10);
+
+	// Distributed spares follow the regular ones, named after parity, top-level index and spare index
+	auto spares = root.at(ZPOOL_CONFIG_SPARES).as_nvlist_array();
+	ASSERT_EQ(spares.size(), 3);
+	EXPECT_EQ(spares[0].at(ZPOOL_CONFIG_PATH).as_string(), files[1]);
+	EXPECT_EQ(spares[1].at(ZPOOL_CONFIG_TYPE).as_string(), VDEV_TYPE_DRAID_SPARE);
+	EXPECT_EQ(spares[1].at(ZPOOL_CONFIG_PATH).as_string(), "draid2-1-0");
+	EXPECT_EQ(spares[2].at(ZPOOL_CONFIG_PATH).as_string(), "draid2-1-1");
+
+	// The data count defaults to at most 8, which fills a row of 10 devices with one group
+	zfspp::vdev_topology defaults;
+	auto draid_default = defaults.draid(2, devices(0, 11), 0, 1).build().at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(draid_default.size(), 1);
+	EXPECT_EQ(draid_default[0].at(ZPOOL_CONFIG_DRAID_NDATA).as_uint64(), 8);
+	EXPECT_EQ(draid_default[0].at(ZPOOL_CONFIG_DRAID_NGROUPS).as_uint64(), 1);
+}
+
+TEST_F(ZFSPP_Topology, Validation) {
+	zfspp::vdev_topology topology;
+	EXPECT_THROW(topology.build(), std::invalid_argument);
+	EXPECT_THROW(topology.ashift(8), std::invalid_argument);
+	EXPECT_THROW(topology.ashift(17), std::invalid_argument);
+	EXPECT_THROW(topology.disk("relative/path"), std::invalid_argument);
+	EXPECT_THROW(topology.disk("/var/tmp"), std::invalid_argument);
+	EXPECT_THROW(topology.disk(files[0], zfspp::vdev_role::cache), std::invalid_argument);
+	EXPECT_THROW(topology.mirror({files[0]}), std::invalid_argument);
+	EXPECT_THROW(topology.mirror(devices(0, 2), zfspp::vdev_role::spare), std::invalid_argument);
+	EXPECT_THROW(topology.mirror({files[0], files[0]}), std::invalid_argument);
+	EXPECT_THROW(topology.raidz(0, devices(0, 3)), std::invalid_argument);
+	EXPECT_THROW(topology.raidz(4, devices(0, 6)), std::invalid_argument);
+	EXPECT_THROW(topology.raidz(2, devices(0, 2)), std::invalid_argument);
+	EXPECT_THROW(topology.draid(1, devices(0, 3), 0, 2), std::invalid_argument);
+	EXPECT_THROW(topology.draid(1, devices(0, 4), 4), std::invalid_argument);
+	EXPECT_THROW(topology.cache({}), std::invalid_argument);
+	EXPECT_THROW(topology.spare({}), std::invalid_argument);
+	EXPECT_TRUE(topology.empty());
+
+	topology.disk(files[0], zfspp::vdev_role::log);
+	// Log devices alone do not make a pool
+	EXPECT_THROW(topology.build(), std::invalid_argument);
+	EXPECT_THROW(topology.mirror(devices(0, 2)), std::invalid_argument);
+	EXPECT_THROW(topology.cache({files[0]}), std::invalid_argument);
+}
+
+TEST_F(ZFSPP_Topology, FailedAddLeavesTopologyUnchanged) {
+	zfspp::vdev_topology topology;
+	topology.disk(files[0]);
+	auto missing = files[2] + "_missing";
+	EXPECT_THROW(topology.mirror({files[1], missing}), std::system_error);
+	EXPECT_THROW(topology.raidz(1, {files[2], files[3], files[0]}), std::invalid_argument);
+
+	// Devices of the failed calls were not marked as used
+	topology.mirror({files[1], files[2]}).spare({files[3]});
+	auto root = topology.build();
+	auto children = root.at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(children.size(), 2);
+	EXPECT_EQ(children[0].at(ZPOOL_CONFIG_PATH).as_string(), files[0]);
+	auto leaves = children[1].at(ZPOOL_CONFIG_CHILDREN).as_nvlist_array();
+	ASSERT_EQ(leaves.size(), 2);
+	EXPECT_EQ(leaves[0].at(ZPOOL_CONFIG_PATH).as_string(), files[1]);
+	EXPECT_EQ(leaves[1].at(ZPOOL_CONFIG_PATH).as_string(), files[2]);
+	EXPECT_EQ(root.at(ZPOOL_CONFIG_SPARES).as_nvlist_array().size(), 1);
+}
+
+namespace {
+	zfspp::nv_list make_vdev(const char* type, uint64_t guid, const char* path = nullptr,
+							 vdev_state_t state = VDEV_STATE_HEALTHY) {
+		zfspp::nv_list res;
+		res.add_string(ZPOOL_CONFIG_TYPE, type);
+		res.add_uint64(ZPOOL_CONFIG_GUID, guid);
+		if (path != nullptr) res.add_string(ZPOOL_CONFIG_PATH, path);
+		vdev_stat_t vs{};
+		vs.vs_state = state;
+		res.add_uint64_array(ZPOOL_CONFIG_VDEV_STATS, reinterpret_cast<const uint64_t*>(&vs),
+							 sizeof(vs) / sizeof(uint64_t));
+		return res;
+	}
+
+	zfspp::nv_list make_group(const char* type, uint64_t guid, std::vector<zfspp::nv_list> children) {
+		auto res = make_vdev(type, guid);
+		res.add_nvlist_array(ZPOOL_CONFIG_CHILDREN, children.data(), children.size());
+		return res;
+	}
+
+	// The leaves get the guids following the one of the mirror
+	zfspp::nv_list make_mirror(uint64_t guid, const char* first, const char* second,
+							   vdev_state_t first_state = VDEV_STATE_HEALTHY) {
+		return make_group(VDEV_TYPE_MIRROR, guid,
+						  {make_vdev(VDEV_TYPE_DISK, guid + 1, first, first_state),
+						   make_vdev(VDEV_TYPE_DISK, guid + 2, second)});
+	}
+
+	// A pool with a normal and a log mirror, special and dedup vdevs, one cache and one spare device
+	zfspp::nv_list make_pool_config(vdev_state_t log_state = VDEV_STATE_HEALTHY, const char* special_path = "/dev/e",
+									bool with_dedup = true) {
+		std::vector<zfspp::nv_list> top;
+		top.push_back(make_mirror(10, "/dev/a", "/dev/b"));
+		top.back().add_uint64(ZPOOL_CONFIG_ASHIFT, 12);
+		top.push_back(make_mirror(20, "/dev/c", "/dev/d", log_state));
+		top.back().add_uint64(ZPOOL_CONFIG_IS_LOG, 1);
+		top.push_back(make_vdev(VDEV_TYPE_DISK, 30, special_path));
+		top.back().add_string(ZPOOL_CONFIG_ALLOCATION_BIAS, VDEV_ALLOC_BIAS_SPECIAL);
+		if (with_dedup) {
+			top.push_back(make_mirror(40, "/dev/f", "/dev/g"));
+			top.back().add_string(ZPOOL_CONFIG_ALLOCATION_BIAS, VDEV_ALLOC_BIAS_DEDUP);
+		}
+		auto root = make_group(VDEV_TYPE_ROOT, 1, std::move(top));
+		auto cache = make_vdev(VDEV_TYPE_DISK, 50, "/dev/h");
+		auto spare = make_vdev(VDEV_TYPE_DISK, 60, "/dev/i");
+		root.add_nvlist_array(ZPOOL_CONFIG_L2CACHE, &cache, 1);
+		root.add_nvlist_array(ZPOOL_CONFIG_SPARES, &spare, 1);
+		zfspp::nv_list config;
+		config.add_nvlist(ZPOOL_CONFIG_VDEV_TREE, root);
+		return config;
+	}
+} // namespace
+
+TEST(ZFSPP_Test, VdevTreeRolesAndParents) {
+	zfspp::vdev_tree tree{make_pool_config()};
+	ASSERT_EQ(tree.size(), 13);
+	const uint64_t guids[] = {1, 10, 11, 12, 20, 21, 22, 30, 40, 41, 42, 50, 60};
+	const size_t parents[] = {zfspp::vdev_tree::npos, 0, 1, 1, 0, 4, 4, 0, 0, 8, 8, 0, 0};
+	using zfspp::vdev_role;
+	const vdev_role roles[] = {vdev_role::normal, vdev_role::normal, vdev_role::normal, vdev_role::normal,
+							   vdev_role::log,    vdev_role::log,    vdev_role::log,    vdev_role::special,
+							   vdev_role::dedup,  vdev_role::dedup,  vdev_role::dedup,  vdev_role::cache,
+							   vdev_role::spare};
+	for (size_t i = 0; i < tree.size(); i++) {
+		EXPECT_EQ(tree[i].guid, guids[i]) << i;
+		EXPECT_EQ(tree[i].parent, parents[i]) << i;
+		EXPECT_EQ(tree[i].role, roles[i]) << i;
+		EXPECT_EQ(tree[i].state, zfspp::vdev_state::healthy) << i;
+		EXPECT_EQ(tree.find(guids[i]), i);
+	}
+	EXPECT_EQ(tree.find(99), zfspp::vdev_tree::npos);
+
+	// Cache and spare devices count as children of the root
+	EXPECT_EQ(tree[0].child_count, 6);
+	EXPECT_EQ(tree[0].subtree_size, 13);
+	EXPECT_EQ(tree[1].child_count, 2);
+	EXPECT_EQ(tree[1].subtree_size, 3);
+	EXPECT_EQ(tree[7].child_count, 0);
+	EXPECT_EQ(tree[0].type, VDEV_TYPE_ROOT);
+	EXPECT_EQ(tree[4].type, VDEV_TYPE_MIRROR);
+	EXPECT_EQ(tree[5].path, "/dev/c");
+	EXPECT_TRUE(tree[4].path.empty());
+	// Leaves inherit the ashift of their top-level vdev
+	EXPECT_EQ(tree[2].ashift, 12);
+	EXPECT_EQ(tree[5].ashift, 0);
+
+	EXPECT_EQ(tree.first_child(0), 1);
+	EXPECT_EQ(tree.first_child(2), zfspp::vdev_tree::npos);
+	EXPECT_EQ(tree.next_sibling(1), 4);
+	EXPECT_EQ(tree.next_sibling(2), 3);
+	EXPECT_EQ(tree.next_sibling(3), zfspp::vdev_tree::npos);
+	EXPECT_EQ(tree.next_sibling(8), 11);
+	EXPECT_EQ(tree.next_sibling(11), 12);
+	EXPECT_EQ(tree.next_sibling(12), zfspp::vdev_tree::npos);
+}
+
+TEST(ZFSPP_Test, VdevTreeUpdate) {
+	zfspp::vdev_tree tree;
+	EXPECT_TRUE(tree.empty());
+	EXPECT_TRUE(tree.update(make_pool_config()));
+	EXPECT_FALSE(tree.update(make_pool_config()));
+
+	EXPECT_TRUE(tree.update(make_pool_config(VDEV_STATE_FAULTED)));
+	EXPECT_EQ(tree[5].state, zfspp::vdev_state::faulted);
+	EXPECT_EQ(tree[5].role, zfspp::vdev_role::log);
+	EXPECT_FALSE(tree.update(make_pool_config(VDEV_STATE_FAULTED)));
+
+	EXPECT_TRUE(tree.update(make_pool_config(VDEV_STATE_HEALTHY, "/dev/disk/by-id/e")));
+	EXPECT_EQ(tree[7].path, "/dev/disk/by-id/e");
+	EXPECT_EQ(tree[7].role, zfspp::vdev_role::special);
+
+	// Removing the dedup mirror shifts the cache and spare devices
+	EXPECT_TRUE(tree.update(make_pool_config(VDEV_STATE_HEALTHY, "/dev/e", false)));
+	ASSERT_EQ(tree.size(), 10);
+	EXPECT_EQ(tree[8].guid, 50);
+	EXPECT_EQ(tree[8].role, zfspp::vdev_role::cache);
+	EXPECT_EQ(tree[9].guid, 60);
+	EXPECT_EQ(tree[9].role, zfspp::vdev_role::spare);
+	EXPECT_EQ(tree[0].child_count, 5);
+	EXPECT_EQ(tree[0].subtree_size, 10);
+	EXPECT_EQ(tree.next_sibling(7), 8);
+
+	EXPECT_THROW(tree.update(zfspp::nv_list{}), std::system_error);
+}